@@ -0,0 +1,275 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "accesslog.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest line formatted for a request. Paths are cut short to fit.
+#define ACCESS_LOG_MAX_LINE 512
+#define ACCESS_LOG_MAX_PATH 256
+
+#define PATH_FIELD "\",\"path\":\""
+#define SUFFIX_FORMAT "\",\"status\":%d,\"bytes\":%llu,\"us\":%lld}\n"
+// Room kept for what follows the path, at its longest: 11 characters of
+// status and 20 each of bytes and microseconds.
+#define SUFFIX_MAX (sizeof(SUFFIX_FORMAT) - 1 + 11 + 20 + 20)
+
+// Single producer, single consumer ring of formatted lines. Only the worker
+// moves `head` and only the flusher moves `tail`; both only ever grow, and
+// are reduced modulo the power of two `capacity` when indexing `data`.
+struct log_buffer
+{
+  char *data;
+  size_t capacity;
+  uint64_t head;
+  uint64_t tail;
+  // Requests left until the next sampled one.
+  uint64_t countdown;
+};
+
+static struct
+{
+  int fd;
+  size_t buffer_size;
+  uint64_t sample_every;
+  pthread_t flusher;
+  bool running;
+  // Appended to under `workers_lock`, read by the flusher without it.
+  pthread_mutex_t workers_lock;
+  struct log_buffer *workers[ACCESS_LOG_MAX_WORKERS];
+  int n_workers;
+  uint64_t dropped;
+  // Only touched by the flusher.
+  uint64_t dropped_reported;
+} access_log = {.fd = -1, .workers_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct log_buffer *worker_buffer = NULL;
+
+static struct log_buffer *add_worker(void)
+{
+  struct log_buffer *buffer = NULL;
+  pthread_mutex_lock(&access_log.workers_lock);
+  if (access_log.n_workers < ACCESS_LOG_MAX_WORKERS && (buffer = calloc(1, sizeof(*buffer))) != NULL)
+  {
+    buffer->capacity = access_log.buffer_size;
+    buffer->countdown = access_log.sample_every;
+    if ((buffer->data = malloc(buffer->capacity)) == NULL)
+    {
+      free(buffer);
+      buffer = NULL;
+    }
+    else
+    {
+      access_log.workers[access_log.n_workers] = buffer;
+      __atomic_store_n(&access_log.n_workers, access_log.n_workers + 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&access_log.workers_lock);
+  return buffer;
+}
+
+// Appends `src` as the inside of a JSON string, escaped.
+static size_t append_escaped(char *dst, size_t len, size_t cap, h2o_iovec_t src)
+{
+  static const char hex[] = "0123456789abcdef";
+  for (size_t k = 0; k < src.len && k < ACCESS_LOG_MAX_PATH; k++)
+  {
+    unsigned char c = (unsigned char)src.base[k];
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+    {
+      if (len + 1 >= cap)
+        break;
+      dst[len++] = c;
+      continue;
+    }
+    if (len + 6 >= cap)
+      break;
+    memcpy(dst + len, "\\u00", 4);
+    dst[len + 4] = hex[c >> 4];
+    dst[len + 5] = hex[c & 0xf];
+    len += 6;
+  }
+  return len;
+}
+
+static size_t format_line(h2o_req_t *req, char *line, size_t cap)
+{
+  const struct timeval *begin = &req->timestamps.request_begin_at;
+  const struct timeval *end = &req->timestamps.response_end_at;
+  int64_t us = 0;
+  if (end->tv_sec != 0)
+    us = (int64_t)(end->tv_sec - begin->tv_sec) * 1000000 + (end->tv_usec - begin->tv_usec);
+
+  size_t len = snprintf(line, cap, "{\"at\":%lld,\"method\":\"", (long long)begin->tv_sec * 1000 + begin->tv_usec / 1000);
+  len = append_escaped(line, len, cap - SUFFIX_MAX - (sizeof(PATH_FIELD) - 1), req->method);
+  len += snprintf(line + len, cap - len, PATH_FIELD);
+  len = append_escaped(line, len, cap - SUFFIX_MAX, req->path);
+  len += snprintf(line + len, cap - len, SUFFIX_FORMAT,
+                  req->res.status, (unsigned long long)req->bytes_sent, (long long)us);
+  return len < cap ? len : cap - 1;
+}
+
+static void log_access(h2o_logger_t *self, h2o_req_t *req)
+{
+  (void)self;
+  struct log_buffer *buffer = worker_buffer;
+  if (buffer == NULL && (buffer = worker_buffer = add_worker()) == NULL)
+  {
+    __atomic_fetch_add(&access_log.dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (access_log.sample_every > 1)
+  {
+    if (--buffer->countdown != 0)
+      return;
+    buffer->countdown = access_log.sample_every;
+  }
+
+  char line[ACCESS_LOG_MAX_LINE];
+  size_t len = format_line(req, line, sizeof(line));
+
+  uint64_t head = buffer->head;
+  uint64_t tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+  if (buffer->capacity - (head - tail) < len)
+  {
+    __atomic_fetch_add(&access_log.dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  size_t at = head & (buffer->capacity - 1);
+  size_t first = len < buffer->capacity - at ? len : buffer->capacity - at;
+  memcpy(buffer->data + at, line, first);
+  memcpy(buffer->data, line + first, len - first);
+  __atomic_store_n(&buffer->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Writes all of `parts`. Whatever can't be written is lost; the log is best
+// effort and the flusher must not stall on a broken consumer.
+static void write_all(struct iovec *parts, int n_parts)
+{
+  while (n_parts > 0)
+  {
+    ssize_t written = writev(access_log.fd, parts, n_parts);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    while (n_parts > 0 && (size_t)written >= parts->iov_len)
+    {
+      written -= parts->iov_len;
+      parts++;
+      n_parts--;
+    }
+    if (n_parts > 0)
+    {
+      parts->iov_base = (char *)parts->iov_base + written;
+      parts->iov_len -= written;
+    }
+  }
+}
+
+static void drain(struct log_buffer *buffer)
+{
+  uint64_t tail = buffer->tail;
+  uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return;
+
+  size_t at = tail & (buffer->capacity - 1);
+  size_t len = head - tail;
+  size_t first = len < buffer->capacity - at ? len : buffer->capacity - at;
+  struct iovec parts[2] = {
+      {.iov_base = buffer->data + at, .iov_len = first},
+      {.iov_base = buffer->data, .iov_len = len - first},
+  };
+  write_all(parts, parts[1].iov_len > 0 ? 2 : 1);
+  __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
+}
+
+static void report_drops(void)
+{
+  uint64_t dropped = __atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED);
+  if (dropped == access_log.dropped_reported)
+    return;
+
+  char line[64];
+  struct iovec part = {.iov_base = line};
+  part.iov_len = snprintf(line, sizeof(line), "{\"dropped\":%llu}\n", (unsigned long long)(dropped - access_log.dropped_reported));
+  write_all(&part, 1);
+  access_log.dropped_reported = dropped;
+}
+
+static void *flush_loop(void *_unused)
+{
+  (void)_unused;
+  struct timespec interval = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_INTERVAL_MS * 1000000L};
+  bool running;
+  do
+  {
+    running = __atomic_load_n(&access_log.running, __ATOMIC_ACQUIRE);
+    int n_workers = __atomic_load_n(&access_log.n_workers, __ATOMIC_ACQUIRE);
+    for (int k = 0; k < n_workers; k++)
+      drain(access_log.workers[k]);
+    report_drops();
+    if (running)
+      nanosleep(&interval, NULL);
+  } while (running);
+  return NULL;
+}
+
+int access_log_start(int fd, size_t buffer_size, uint64_t sample_every)
+{
+  // Round up to a power of two so positions wrap with a mask.
+  size_t capacity = ACCESS_LOG_MAX_LINE;
+  while (capacity < buffer_size)
+    capacity <<= 1;
+
+  access_log.fd = fd;
+  access_log.buffer_size = capacity;
+  access_log.sample_every = sample_every;
+  access_log.dropped = access_log.dropped_reported = 0;
+  __atomic_store_n(&access_log.running, true, __ATOMIC_RELEASE);
+  if (pthread_create(&access_log.flusher, NULL, flush_loop, NULL) != 0)
+  {
+    access_log.running = false;
+    return -1;
+  }
+  return 0;
+}
+
+void access_log_register(h2o_pathconf_t *pathconf)
+{
+  h2o_logger_t *logger = h2o_create_logger(pathconf, sizeof(*logger));
+  logger->log_access = log_access;
+}
+
+void access_log_stop(void)
+{
+  if (!access_log.running)
+    return;
+  __atomic_store_n(&access_log.running, false, __ATOMIC_RELEASE);
+  pthread_join(access_log.flusher, NULL);
+
+  for (int k = 0; k < access_log.n_workers; k++)
+  {
+    free(access_log.workers[k]->data);
+    free(access_log.workers[k]);
+  }
+  access_log.n_workers = 0;
+  worker_buffer = NULL;
+}
+
+uint64_t access_log_dropped(void)
+{
+  return __atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED);
+}
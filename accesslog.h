@@ -0,0 +1,35 @@
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+#include <stdint.h>
+
+#include "h2o.h"
+
+// Default size of each worker's buffer. At ~150 bytes a line this holds
+// about 28k requests between flushes.
+#define ACCESS_LOG_BUFFER_SIZE (4 * 1024 * 1024)
+#define ACCESS_LOG_FLUSH_INTERVAL_MS 50
+#define ACCESS_LOG_MAX_WORKERS 16
+
+// Access log that writes one JSON object per request:
+//
+//   {"at":1700000000123,"method":"GET","path":"/evaluate/x","status":200,"bytes":17,"us":85}
+//
+// Each event loop thread formats into its own lock-free buffer, and a
+// background thread drains all of them into `fd` in large writes. Lines that
+// don't fit because the consumer is behind are dropped and counted; the
+// count is written to the log as {"dropped":N} once there is room again.
+//
+// Logs 1 in `sample_every` requests; 0 or 1 logs all of them.
+int access_log_start(int fd, size_t buffer_size, uint64_t sample_every);
+
+// Log requests handled under `pathconf`.
+void access_log_register(h2o_pathconf_t *pathconf);
+
+// Flush what is buffered and stop the background thread.
+void access_log_stop(void);
+
+// Lines dropped since start.
+uint64_t access_log_dropped(void);
+
+#endif // ACCESSLOG_H_
@@ -0,0 +1,174 @@
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "evaluation.h"
+
+#define BATCH_ERROR_LINE(error_code) "{\"error\":\"" error_code "\"}\n"
+
+void batch_init(struct batch *batch, const char *key)
+{
+  memset(batch, 0, sizeof(*batch));
+  batch->tokener = json_tokener_new();
+  batch->key = key;
+  h2o_buffer_init(&batch->partial, &h2o_socket_buffer_prototype);
+  h2o_buffer_init(&batch->pending, &h2o_socket_buffer_prototype);
+}
+
+void batch_dispose(struct batch *batch)
+{
+  json_tokener_free(batch->tokener);
+  free(batch->results);
+  h2o_buffer_dispose(&batch->partial);
+  h2o_buffer_dispose(&batch->pending);
+}
+
+static bool append(h2o_buffer_t **buf, const char *src, size_t len)
+{
+  h2o_iovec_t reserved = h2o_buffer_reserve(buf, len);
+  if (reserved.base == NULL)
+    return false;
+  memcpy(reserved.base, src, len);
+  (*buf)->size += len;
+  return true;
+}
+
+static bool is_blank(const char *pos, const char *end)
+{
+  for (; pos < end; pos++)
+    if (*pos != ' ' && *pos != '\t' && *pos != '\r')
+      return false;
+  return true;
+}
+
+// Parse `line` as a context. Anything after the object other than whitespace
+// makes the line malformed.
+static json_object *parse_line(json_tokener *tokener, const char *line, size_t len)
+{
+  json_tokener_reset(tokener);
+  json_object *context = json_tokener_parse_ex(tokener, line, (int)len);
+  if (context == NULL || json_tokener_get_error(tokener) != json_tokener_success ||
+      !is_blank(line + json_tokener_get_parse_end(tokener), line + len))
+  {
+    json_object_put(context);
+    return NULL;
+  }
+  return context;
+}
+
+// Evaluate one line of input and append its result line to `pending`.
+static void evaluate_line(struct batch *batch, const struct evaluation_plan *plan, const char *line, size_t len)
+{
+  json_object *context = parse_line(batch->tokener, line, len);
+  if (context == NULL || !json_object_is_type(context, json_type_object) || !is_valid_context(context))
+  {
+    json_object_put(context);
+    append(&batch->pending, STRLIT(BATCH_ERROR_LINE("N0004 - malformed request body")));
+    return;
+  }
+
+  int target = batch->key == NULL ? -1 : find_plan_step(plan, batch->key);
+  if (batch->key != NULL && target < 0)
+  {
+    json_object_put(context);
+    append(&batch->pending, STRLIT(BATCH_ERROR_LINE("N0005 - no such flag")));
+    return;
+  }
+
+  json_object *states = json_object_new_object();
+  if (target < 0)
+  {
+    evaluate_plan_all(plan, context, batch->results);
+    for (int k = 0; k < plan->n_steps; k++)
+      json_object_object_add(states, plan->steps[k].key, json_object_new_boolean(batch->results[k]));
+  }
+  else
+  {
+    evaluate_plan(plan, target, context, batch->results);
+    const struct plan_step *step = &plan->steps[target];
+    for (int c = 0; c < step->n_closure; c++)
+      json_object_object_add(states, plan->steps[step->closure[c]].key, json_object_new_boolean(batch->results[step->closure[c]]));
+  }
+  json_object_put(context);
+
+  size_t serialized_len = 0;
+  const char *serialized = json_object_to_json_string_length(states, JSON_C_TO_STRING_PLAIN, &serialized_len);
+  append(&batch->pending, serialized, serialized_len);
+  append(&batch->pending, STRLIT("\n"));
+  json_object_put(states);
+}
+
+static void process_line(struct batch *batch, const struct evaluation_plan *plan, const char *line, size_t len)
+{
+  if (is_blank(line, line + len))
+    return;
+  // The response has already started, so running out of memory for results
+  // can only be reported line by line.
+  if (batch->results == NULL)
+    append(&batch->pending, STRLIT(BATCH_ERROR_LINE("N0008 - out of memory")));
+  else
+    evaluate_line(batch, plan, line, len);
+}
+
+size_t batch_evaluate_chunk(struct batch *batch, const struct evaluation_plan *plan, const char *chunk, size_t len, bool is_end_stream)
+{
+  if (batch->results_capacity < plan->n_steps + 1)
+  {
+    free(batch->results);
+    batch->results = malloc((plan->n_steps + 1) * sizeof(bool));
+    batch->results_capacity = batch->results == NULL ? 0 : plan->n_steps + 1;
+  }
+
+  const char *pos = chunk;
+  const char *end = chunk + len;
+  while (pos < end && batch->pending->size < BATCH_PENDING_HIGH_WATER)
+  {
+    const char *newline = memchr(pos, '\n', end - pos);
+    const char *piece_end = newline != NULL ? newline : end;
+    if (batch->discarding)
+    {
+      batch->discarding = newline == NULL;
+      pos = newline != NULL ? newline + 1 : end;
+      continue;
+    }
+    if (batch->partial->size + (piece_end - pos) > BATCH_MAX_LINE)
+    {
+      append(&batch->pending, STRLIT(BATCH_ERROR_LINE("N0009 - line too long")));
+      h2o_buffer_consume(&batch->partial, batch->partial->size);
+      batch->discarding = newline == NULL;
+      pos = newline != NULL ? newline + 1 : end;
+      continue;
+    }
+    if (newline == NULL)
+    {
+      append(&batch->partial, pos, end - pos);
+      pos = end;
+      break;
+    }
+
+    const char *line = pos;
+    size_t line_len = newline - pos;
+    if (batch->partial->size != 0)
+    {
+      append(&batch->partial, pos, line_len);
+      line = batch->partial->bytes;
+      line_len = batch->partial->size;
+    }
+    process_line(batch, plan, line, line_len);
+    h2o_buffer_consume(&batch->partial, batch->partial->size);
+    pos = newline + 1;
+  }
+
+  if (pos < end)
+    return pos - chunk;
+  if (is_end_stream)
+    batch->discarding = false;
+  if (is_end_stream && batch->partial->size != 0)
+  {
+    process_line(batch, plan, batch->partial->bytes, batch->partial->size);
+    h2o_buffer_consume(&batch->partial, batch->partial->size);
+  }
+  return len;
+}
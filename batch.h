@@ -0,0 +1,52 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "h2o.h"
+#include "json-c/json.h"
+
+struct evaluation_plan;
+
+// Longest input line. Longer lines get an error line and are skipped, rather
+// than buffered until their newline.
+#define BATCH_MAX_LINE (64 * 1024)
+// Result lines held before input stops being taken. Each input line can
+// expand to a result per flag, so output is bounded here, not by the input.
+#define BATCH_PENDING_HIGH_WATER H2O_SOCKET_INITIAL_INPUT_BUFFER_SIZE
+
+// Newline-delimited JSON contexts in, one NDJSON result line per context out:
+// `{ key: state }` for the flag and its prerequisites, or for every flag, and
+// `{"error": ...}` for lines that aren't a valid context. Input may be split
+// anywhere across chunks.
+struct batch
+{
+  json_tokener *tokener;
+
+  // Flag to evaluate, or NULL for all flags. Looked up per line, as the plan
+  // may be recompiled between chunks.
+  const char *key;
+  bool *results;
+  int results_capacity;
+
+  // Trailing line of the last chunk that hasn't seen its newline yet.
+  h2o_buffer_t *partial;
+  // Skipping the rest of a line over BATCH_MAX_LINE.
+  bool discarding;
+  // Result lines not yet taken by the caller.
+  h2o_buffer_t *pending;
+};
+
+void batch_init(struct batch *batch, const char *key);
+void batch_dispose(struct batch *batch);
+
+// Evaluate complete lines in `chunk` against `plan` and append the results to
+// `pending`, until `pending` reaches BATCH_PENDING_HIGH_WATER. Returns how much
+// of `chunk` was taken; the rest has to be passed again once `pending` has
+// been drained. An incomplete last line is carried over to the next chunk, or
+// evaluated as is if `is_end_stream`. Blank lines are skipped, and lines may
+// end in CRLF. Lines over BATCH_MAX_LINE get an error line.
+size_t batch_evaluate_chunk(struct batch *batch, const struct evaluation_plan *plan, const char *chunk, size_t len, bool is_end_stream);
+
+#endif // BATCH_H_
@@ -0,0 +1,135 @@
+// Compares JSON and MessagePack for the evaluation endpoints: bytes on the
+// wire and ns/op to decode a context and to encode a response.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json-c/json.h"
+
+#include "msgpack.h"
+
+#define ITERATIONS 200000
+
+static const char *contexts[] = {
+    "{\"userId\":5}",
+    "{\"userId\":5,\"country\":\"US\",\"plan\":\"pro\",\"beta\":true}",
+    "{\"userId\":5,\"country\":\"US\",\"plan\":\"pro\",\"platform\":\"ios\",\"appVersion\":\"4.2.0\","
+    "\"beta\":true,\"orgId\":311,\"locale\":\"en-US\",\"sessionAge\":1800,\"carMake\":\"Honda\","
+    "\"attr0\":12,\"attr1\":43,\"attr2\":74,\"attr3\":8,\"attr4\":39,\"attr5\":70,\"attr6\":4,"
+    "\"attr7\":35,\"attr8\":66,\"attr9\":0}",
+};
+
+// Number of flags in the encoded responses.
+#define N_RESULTS 20
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t encode_context(struct json_object *context, uint8_t *dst)
+{
+  uint8_t *end = msgpack_write_map_header(dst, json_object_object_length(context));
+  json_object_object_foreach(context, key, val)
+  {
+    end = msgpack_write_str(end, key, strlen(key));
+    switch (json_object_get_type(val))
+    {
+    case json_type_boolean:
+      end = msgpack_write_bool(end, json_object_get_boolean(val));
+      break;
+    case json_type_int:
+      end = msgpack_write_int(end, json_object_get_int64(val));
+      break;
+    case json_type_double:
+      end = msgpack_write_double(end, json_object_get_double(val));
+      break;
+    case json_type_string:
+      end = msgpack_write_str(end, json_object_get_string(val), json_object_get_string_len(val));
+      break;
+    default:
+      end = msgpack_write_nil(end);
+      break;
+    }
+  }
+  return end - dst;
+}
+
+static void bench_context(const char *json)
+{
+  size_t json_len = strlen(json);
+  struct json_object *context = json_tokener_parse(json);
+  uint8_t packed[1024];
+  size_t packed_len = encode_context(context, packed);
+  int n_keys = json_object_object_length(context);
+  json_object_put(context);
+
+  double start = now_ns();
+  for (int k = 0; k < ITERATIONS; k++)
+  {
+    json_tokener *tokener = json_tokener_new();
+    json_object_put(json_tokener_parse_ex(tokener, json, (int)json_len));
+    json_tokener_free(tokener);
+  }
+  double json_ns = (now_ns() - start) / ITERATIONS;
+
+  start = now_ns();
+  for (int k = 0; k < ITERATIONS; k++)
+    json_object_put(msgpack_decode_context(packed, packed_len));
+  double msgpack_ns = (now_ns() - start) / ITERATIONS;
+
+  printf("decode %2d keys  %6zu B %8.1f ns/op  %6zu B %8.1f ns/op\n",
+         n_keys, json_len, json_ns, packed_len, msgpack_ns);
+}
+
+static void bench_response(void)
+{
+  char keys[N_RESULTS][32];
+  for (int k = 0; k < N_RESULTS; k++)
+    snprintf(keys[k], sizeof(keys[k]), "flag-%d", k * 37);
+
+  size_t json_len = 0;
+  double start = now_ns();
+  for (int k = 0; k < ITERATIONS; k++)
+  {
+    struct json_object *response = json_object_new_object();
+    for (int r = 0; r < N_RESULTS; r++)
+      json_object_object_add(response, keys[r], json_object_new_boolean(r % 2));
+    json_object_to_json_string_length(response, JSON_C_TO_STRING_PLAIN, &json_len);
+    json_object_put(response);
+  }
+  double json_ns = (now_ns() - start) / ITERATIONS;
+
+  uint8_t packed[1024];
+  size_t packed_len = 0;
+  start = now_ns();
+  for (int k = 0; k < ITERATIONS; k++)
+  {
+    uint8_t *end = msgpack_write_map_header(packed, N_RESULTS);
+    for (int r = 0; r < N_RESULTS; r++)
+    {
+      end = msgpack_write_str(end, keys[r], strlen(keys[r]));
+      end = msgpack_write_bool(end, r % 2);
+    }
+    packed_len = end - packed;
+  }
+  double msgpack_ns = (now_ns() - start) / ITERATIONS;
+
+  printf("encode %2d flags %6zu B %8.1f ns/op  %6zu B %8.1f ns/op\n",
+         N_RESULTS, json_len, json_ns, packed_len, msgpack_ns);
+}
+
+int main(void)
+{
+  printf("%-15s %22s  %22s\n", "", "json", "msgpack");
+  for (size_t k = 0; k < sizeof(contexts) / sizeof(contexts[0]); k++)
+    bench_context(contexts[k]);
+  bench_response();
+  return 0;
+}
@@ -3,13 +3,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "common.h"
 #include "json-c/json.h"
 #include "evaluation.h"
 
 static void profile_db(void *context, const char *sql, sqlite3_uint64 ns);
+static int trace_db(unsigned type, void *context, void *statement, void *detail);
 int initialize_db_base(sqlite3 **db, int inmemory);
 
 static void profile_db(void *context, const char *sql, sqlite3_uint64 ns)
@@ -18,6 +21,38 @@ static void profile_db(void *context, const char *sql, sqlite3_uint64 ns)
   fprintf(stderr, "Execution Time: %llu ms\n", ns / 1000000);
 }
 
+static void (*statement_observer)(const char *sql) = NULL;
+
+static int trace_db(unsigned type, void *context, void *statement, void *detail)
+{
+  if (type == SQLITE_TRACE_STMT && statement_observer != NULL)
+    statement_observer(sqlite3_sql(statement));
+  else if (type == SQLITE_TRACE_PROFILE)
+    profile_db(context, sqlite3_sql(statement), *(sqlite3_uint64 *)detail);
+  return 0;
+}
+
+void db_observe_statements(void (*observer)(const char *sql))
+{
+  statement_observer = observer;
+}
+
+// Statements run on every evaluation, prepared once per connection. SQLite is
+// single-threaded here, so one set is enough.
+static struct
+{
+  sqlite3 *db;
+  sqlite3_stmt *key_upsert;
+  sqlite3_stmt *value_upsert;
+} context_statements;
+
+static void finalize_context_statements(void)
+{
+  sqlite3_finalize(context_statements.key_upsert);
+  sqlite3_finalize(context_statements.value_upsert);
+  memset(&context_statements, 0, sizeof(context_statements));
+}
+
 int initialize_db_base(sqlite3 **db, int inmemory)
 {
   int config_result = sqlite3_config(SQLITE_CONFIG_SINGLETHREAD);
@@ -47,7 +82,7 @@ int initialize_db_base(sqlite3 **db, int inmemory)
     fprintf(stderr, "failed to open sqlite database: %s\n", sqlite3_errmsg(*db));
     return 1;
   }
-  sqlite3_profile(*db, &profile_db, NULL);
+  sqlite3_trace_v2(*db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, &trace_db, NULL);
 
   // TODO: verify and correct schema
   if (migrate(*db) != 0)
@@ -70,6 +105,8 @@ int initialize_db(sqlite3 **db)
 
 int close_db(sqlite3 **db)
 {
+  if (context_statements.db == *db)
+    finalize_context_statements();
   if (sqlite3_close(*db) != SQLITE_OK)
     return 1;
   sqlite3_shutdown();
@@ -86,11 +123,58 @@ int db_commit(sqlite3 *db)
   return sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
 }
 
+int db_rollback(sqlite3 *db)
+{
+  return sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+}
+
 #define MUST_EXEC(expr) \
   assert(sqlite3_exec(db, expr, NULL, NULL, NULL) == SQLITE_OK);
 
+static int pragma_int(sqlite3 *db, const char *sql)
+{
+  sqlite3_stmt *statement = NULL;
+  int value = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+    return -1;
+  if (sqlite3_step(statement) == SQLITE_ROW)
+    value = sqlite3_column_int(statement, 0);
+  sqlite3_finalize(statement);
+  return value;
+}
+
+// Adds `column` to databases created before it existed.
+static void ensure_column(sqlite3 *db, const char *table, const char *column, const char *definition)
+{
+  char sql[256];
+  snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM pragma_table_info('%s') WHERE name = '%s'", table, column);
+  if (pragma_int(db, sql) != 0)
+    return;
+  snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s %s", table, column, definition);
+  MUST_EXEC(sql);
+}
+
 int migrate(sqlite3 *db)
 {
+  // Lets `db_incremental_vacuum` hand pages freed by purges back to the
+  // filesystem. Only takes effect on an empty database, older files are
+  // rebuilt once. The rebuild blocks startup and needs free space of about
+  // twice the file size while it runs.
+  if (pragma_int(db, "PRAGMA auto_vacuum") != 2)
+  {
+    MUST_EXEC("PRAGMA auto_vacuum = INCREMENTAL");
+    if (pragma_int(db, "SELECT COUNT(*) FROM sqlite_master") > 0)
+    {
+      int64_t size = (int64_t)pragma_int(db, "PRAGMA page_count") * pragma_int(db, "PRAGMA page_size");
+      fprintf(stderr, "rebuilding the %lld KB database once to enable incremental vacuum; "
+                      "this needs about as much free disk space again and may take a while\n",
+              (long long)(size >> 10));
+      time_t started = time(NULL);
+      MUST_EXEC("VACUUM");
+      fprintf(stderr, "rebuilt the database in %lld s\n", (long long)(time(NULL) - started));
+    }
+  }
+
   assert(db_begin(db) == SQLITE_OK);
 
   MUST_EXEC(
@@ -106,7 +190,8 @@ int migrate(sqlite3 *db)
       "CREATE TABLE IF NOT EXISTS "
       "request_meta_key ("
       "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-      "key_name VARCHAR(128) UNIQUE NOT NULL"
+      "key_name VARCHAR(128) UNIQUE NOT NULL,"
+      "last_seen INTEGER NOT NULL DEFAULT 0"
       ")");
 
   // Binds observed meta to feature flags.
@@ -117,14 +202,25 @@ int migrate(sqlite3 *db)
             ")");
 
   // Observed values for a given key over the lifetime of the application.
+  // `n_observed` counts the CONTEXT_BUCKET_SECONDS buckets a value was seen
+  // in, not requests: it goes up at most once a bucket.
   MUST_EXEC(
       "CREATE TABLE IF NOT EXISTS "
       "request_meta_values ("
       "meta_key_id INTEGER REFERENCES request_meta_key(id),"
       "key_name VARCHAR(128) NOT NULL,"
-      "n_observed INT NOT NULL DEFAULT 1"
+      "n_observed INT NOT NULL DEFAULT 1,"
+      "last_seen INTEGER NOT NULL DEFAULT 0"
       ")");
 
+  // `last_seen` is the start of the CONTEXT_BUCKET_SECONDS bucket a key or
+  // value was last observed in; `db_purge_context_metrics` ages rows out by it.
+  ensure_column(db, "request_meta_key", "last_seen", "INTEGER NOT NULL DEFAULT 0");
+  ensure_column(db, "request_meta_values", "last_seen", "INTEGER NOT NULL DEFAULT 0");
+  MUST_EXEC("CREATE UNIQUE INDEX IF NOT EXISTS request_meta_values_key_value ON request_meta_values (meta_key_id, key_name)");
+  MUST_EXEC("CREATE INDEX IF NOT EXISTS request_meta_key_last_seen ON request_meta_key (last_seen)");
+  MUST_EXEC("CREATE INDEX IF NOT EXISTS request_meta_values_last_seen ON request_meta_values (last_seen)");
+
   MUST_EXEC(
       "CREATE TABLE IF NOT EXISTS "
       "feature_flag_default_state ("
@@ -132,49 +228,572 @@ int migrate(sqlite3 *db)
       "enabled BOOLEAN NOT NULL DEFAULT 'false'"
       ")");
 
+  // Rule a context has to match for the flag to be on, as JSON. Flags without
+  // a rule fall back to their default state.
+  MUST_EXEC(
+      "CREATE TABLE IF NOT EXISTS "
+      "feature_flag_rules ("
+      "feature_flag_id INTEGER PRIMARY KEY REFERENCES feature_flags (id),"
+      "rule TEXT NOT NULL"
+      ")");
+
+  // Every flag write, as the full flag document after the write. Replicas
+  // follow this through `db_changes_since`.
+  MUST_EXEC(
+      "CREATE TABLE IF NOT EXISTS "
+      "flag_changes ("
+      "version INTEGER PRIMARY KEY AUTOINCREMENT,"
+      "flag_id INTEGER NOT NULL REFERENCES feature_flags (id),"
+      "document TEXT NOT NULL"
+      ")");
+
+  // A flag is only on if all of its prerequisites are on. Kept acyclic by
+  // `db_put_flag`.
+  MUST_EXEC(
+      "CREATE TABLE IF NOT EXISTS "
+      "feature_flag_prerequisites ("
+      "flag_id INTEGER NOT NULL REFERENCES feature_flags (id),"
+      "prerequisite_id INTEGER NOT NULL REFERENCES feature_flags (id),"
+      "PRIMARY KEY (flag_id, prerequisite_id)"
+      ")");
+
   assert(db_commit(db) == SQLITE_OK);
   return 0;
 }
 
-bool record_context_metrics(sqlite3 *db, struct json_object *context)
+// Runs a prepared statement that returns no rows to completion and finalizes it.
+static int step_done(sqlite3_stmt *statement)
 {
-  if (!is_valid_context(context))
-    return false;
+  int result = sqlite3_step(statement);
+  sqlite3_finalize(statement);
+  return result;
+}
 
-  if (db_begin(db) != SQLITE_OK)
-  {
-    return false;
-  }
+static int bind_int64(sqlite3_stmt *statement, const char *name, int64_t value)
+{
+  return sqlite3_bind_int64(statement, sqlite3_bind_parameter_index(statement, name), value);
+}
+
+static int bind_text(sqlite3_stmt *statement, const char *name, const char *value)
+{
+  return sqlite3_bind_text(statement, sqlite3_bind_parameter_index(statement, name), value, -1, SQLITE_TRANSIENT);
+}
+
+// Runs a prepared statement that returns no rows and resets it for reuse.
+static int step_reset(sqlite3_stmt *statement)
+{
+  int result = sqlite3_step(statement);
+  sqlite3_reset(statement);
+  return result;
+}
+
+bool record_context_metrics(sqlite3 *db, struct json_object *context)
+{
+  return record_context_metrics_at(db, context, (int64_t)time(NULL));
+}
 
-  sqlite3_stmt *insertion = NULL;
+static bool prepare_context_statements(sqlite3 *db)
+{
+  if (context_statements.db == db)
+    return true;
+  finalize_context_statements();
   if (sqlite3_prepare_v2(db,
                          STRLIT(
-                             "INSERT INTO request_meta_key (key_name) "
-                             "VALUES (@keyName) "
-                             "ON CONFLICT (key_name) DO NOTHING"),
-                         &insertion,
+                             "INSERT INTO request_meta_key (key_name, last_seen) "
+                             "VALUES (@keyName, @seen) "
+                             "ON CONFLICT (key_name) DO UPDATE SET last_seen = excluded.last_seen "
+                             "WHERE last_seen < excluded.last_seen"),
+                         &context_statements.key_upsert,
+                         NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db,
+                         STRLIT(
+                             "INSERT INTO request_meta_values (meta_key_id, key_name, last_seen) "
+                             "SELECT id, @value, @seen FROM request_meta_key WHERE key_name = @keyName "
+                             "ON CONFLICT (meta_key_id, key_name) DO UPDATE "
+                             "SET n_observed = n_observed + 1, last_seen = excluded.last_seen "
+                             "WHERE last_seen < excluded.last_seen"),
+                         &context_statements.value_upsert,
                          NULL) != SQLITE_OK)
   {
     fprintf(stderr, "failed to initialize statement: %s\n", sqlite3_errmsg(db));
+    finalize_context_statements();
     return false;
   }
+  context_statements.db = db;
+  return true;
+}
+
+bool record_context_metrics_at(sqlite3 *db, struct json_object *context, int64_t now)
+{
+  if (!is_valid_context(context))
+    return false;
+
+  // Rows are only rewritten when they move to a new bucket, so a hot key
+  // costs one write per bucket rather than one per request.
+  int64_t bucket = now - now % CONTEXT_BUCKET_SECONDS;
+
+  if (!prepare_context_statements(db) || db_begin(db) != SQLITE_OK)
+    return false;
 
+  sqlite3_stmt *key_upsert = context_statements.key_upsert;
+  sqlite3_stmt *value_upsert = context_statements.value_upsert;
   json_object_object_foreach(context, entry_key, entry_val)
   {
-    const char *serialized = json_object_to_json_string(entry_val);
-    if (sqlite3_bind_text(insertion, sqlite3_bind_parameter_index(insertion, "@keyName"), STRLIT(serialized), NULL) != SQLITE_OK)
+    bind_text(key_upsert, "@keyName", entry_key);
+    bind_int64(key_upsert, "@seen", bucket);
+    bind_text(value_upsert, "@keyName", entry_key);
+    bind_text(value_upsert, "@value", json_object_to_json_string(entry_val));
+    bind_int64(value_upsert, "@seen", bucket);
+    if (step_reset(key_upsert) != SQLITE_DONE || step_reset(value_upsert) != SQLITE_DONE)
     {
-      sqlite3_finalize(insertion);
+      db_rollback(db);
       return false;
     }
+  }
+  return db_commit(db) == SQLITE_OK;
+}
+
+// Deletes up to `limit` rows matched by `sql`, which selects rowids using
+// `@cutoff` and `@limit`. Returns the number of rows deleted or -1.
+static int purge_rows(sqlite3 *db, const char *sql, int64_t cutoff, int limit)
+{
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+    return -1;
+  bind_int64(statement, "@cutoff", cutoff);
+  bind_int64(statement, "@limit", limit);
+  if (step_done(statement) != SQLITE_DONE)
+    return -1;
+  return sqlite3_changes(db);
+}
+
+int db_purge_context_metrics(sqlite3 *db, int64_t now, int64_t key_ttl, int64_t value_ttl, int limit)
+{
+  int purged = 0;
+  if (value_ttl > 0)
+  {
+    int values = purge_rows(db,
+                            "DELETE FROM request_meta_values WHERE rowid IN ("
+                            "SELECT rowid FROM request_meta_values WHERE last_seen < @cutoff LIMIT @limit)",
+                            now - value_ttl,
+                            limit);
+    if (values < 0)
+      return -1;
+    purged += values;
+  }
+
+  // Keys still holding values or bound to a flag are kept regardless of age.
+  if (key_ttl > 0 && purged < limit)
+  {
+    int keys = purge_rows(db,
+                          "DELETE FROM request_meta_key WHERE id IN ("
+                          "SELECT id FROM request_meta_key WHERE last_seen < @cutoff "
+                          "AND NOT EXISTS (SELECT 1 FROM request_meta_values WHERE meta_key_id = request_meta_key.id) "
+                          "AND NOT EXISTS (SELECT 1 FROM flags_meta WHERE meta_key_id = request_meta_key.id) "
+                          "LIMIT @limit)",
+                          now - key_ttl,
+                          limit - purged);
+    if (keys < 0)
+      return -1;
+    purged += keys;
+  }
+  return purged;
+}
 
-    int stmt_result = 0;
-    do
+int db_incremental_vacuum(sqlite3 *db, int pages)
+{
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d)", pages);
+  // The pragma frees one page per step.
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  int result;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+    ;
+  sqlite3_finalize(statement);
+  return result == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+static int find_flag_id(sqlite3 *db, const char *key, int64_t *id)
+{
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(db, STRLIT("SELECT id FROM feature_flags WHERE key = replace(@key, ' ', '-')"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_text(statement, "@key", key);
+
+  int result = sqlite3_step(statement);
+  if (result == SQLITE_ROW)
+    *id = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  if (result == SQLITE_ROW)
+    return DB_OK;
+  return result == SQLITE_DONE ? DB_NOT_FOUND : DB_ERROR;
+}
+
+static int put_flag_row(sqlite3 *db, struct json_object *flag, bool create, int64_t *id)
+{
+  sqlite3_stmt *statement = NULL;
+  struct json_object *key = json_object_object_get(flag, "key");
+  struct json_object *name = NULL;
+  bool has_name = json_object_object_get_ex(flag, "name", &name);
+  if (has_name && !json_object_is_type(name, json_type_string))
+    return DB_INVALID;
+
+  if (!create)
+  {
+    int found = find_flag_id(db, json_object_get_string(key), id);
+    if (found != DB_OK || !has_name)
+      return found;
+
+    if (sqlite3_prepare_v2(db, STRLIT("UPDATE feature_flags SET name = @name WHERE id = @id"), &statement, NULL) != SQLITE_OK)
+      return DB_ERROR;
+    bind_text(statement, "@name", json_object_get_string(name));
+    bind_int64(statement, "@id", *id);
+    return step_done(statement) == SQLITE_DONE ? DB_OK : DB_ERROR;
+  }
+
+  if (sqlite3_prepare_v2(db, STRLIT("INSERT INTO feature_flags (name, key) VALUES (@name, replace(@key, ' ', '-'))"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_text(statement, "@name", json_object_get_string(has_name ? name : key));
+  bind_text(statement, "@key", json_object_get_string(key));
+
+  int result = step_done(statement);
+  if (result == SQLITE_CONSTRAINT)
+    return DB_CONFLICT;
+  if (result != SQLITE_DONE)
+    return DB_ERROR;
+  *id = sqlite3_last_insert_rowid(db);
+  return DB_OK;
+}
+
+static int put_flag_state(sqlite3 *db, int64_t id, struct json_object *enabled)
+{
+  sqlite3_stmt *statement = NULL;
+  if (!json_object_is_type(enabled, json_type_boolean))
+    return DB_INVALID;
+
+  if (sqlite3_prepare_v2(db, STRLIT("DELETE FROM feature_flag_default_state WHERE feature_flag_id = @id"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@id", id);
+  if (step_done(statement) != SQLITE_DONE)
+    return DB_ERROR;
+
+  if (sqlite3_prepare_v2(db, STRLIT("INSERT INTO feature_flag_default_state (feature_flag_id, enabled) VALUES (@id, @enabled)"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@id", id);
+  sqlite3_bind_int(statement, sqlite3_bind_parameter_index(statement, "@enabled"), json_object_get_boolean(enabled));
+  return step_done(statement) == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+static int put_flag_rule(sqlite3 *db, int64_t id, struct json_object *rule)
+{
+  sqlite3_stmt *statement = NULL;
+  if (rule == NULL)
+  {
+    if (sqlite3_prepare_v2(db, STRLIT("DELETE FROM feature_flag_rules WHERE feature_flag_id = @id"), &statement, NULL) != SQLITE_OK)
+      return DB_ERROR;
+    bind_int64(statement, "@id", id);
+    return step_done(statement) == SQLITE_DONE ? DB_OK : DB_ERROR;
+  }
+
+  if (!json_object_is_type(rule, json_type_object) || !is_valid_rule(rule))
+    return DB_INVALID;
+
+  if (sqlite3_prepare_v2(db, STRLIT("INSERT OR REPLACE INTO feature_flag_rules (feature_flag_id, rule) VALUES (@id, @rule)"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@id", id);
+  bind_text(statement, "@rule", json_object_to_json_string_ext(rule, JSON_C_TO_STRING_PLAIN));
+  return step_done(statement) == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+static int put_flag_prerequisites(sqlite3 *db, int64_t id, struct json_object *prerequisites)
+{
+  sqlite3_stmt *statement = NULL;
+  if (!json_object_is_type(prerequisites, json_type_array))
+    return DB_INVALID;
+
+  if (sqlite3_prepare_v2(db, STRLIT("DELETE FROM feature_flag_prerequisites WHERE flag_id = @id"), &statement, NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@id", id);
+  if (step_done(statement) != SQLITE_DONE)
+    return DB_ERROR;
+
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("INSERT OR IGNORE INTO feature_flag_prerequisites (flag_id, prerequisite_id) "
+                                "VALUES (@id, @prerequisiteId)"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+    return DB_ERROR;
+  for (size_t k = 0; k < json_object_array_length(prerequisites); k++)
+  {
+    struct json_object *prerequisite = json_object_array_get_idx(prerequisites, k);
+    if (!json_object_is_type(prerequisite, json_type_string))
+    {
+      sqlite3_finalize(statement);
+      return DB_INVALID;
+    }
+
+    // A prerequisite has to exist already, which also rules out a flag
+    // created with itself as a prerequisite.
+    int64_t prerequisite_id = -1;
+    int found = find_flag_id(db, json_object_get_string(prerequisite), &prerequisite_id);
+    if (found != DB_OK)
+    {
+      sqlite3_finalize(statement);
+      return found == DB_NOT_FOUND ? DB_INVALID : found;
+    }
+
+    sqlite3_reset(statement);
+    bind_int64(statement, "@id", id);
+    bind_int64(statement, "@prerequisiteId", prerequisite_id);
+    if (sqlite3_step(statement) != SQLITE_DONE)
     {
-      stmt_result = sqlite3_step(insertion);
-    } while (stmt_result != SQLITE_DONE);
+      sqlite3_finalize(statement);
+      return DB_ERROR;
+    }
   }
+  sqlite3_finalize(statement);
 
-  sqlite3_finalize(insertion);
-  return db_commit(db) == SQLITE_OK;
-}
\ No newline at end of file
+  // The graph was acyclic before this write and only this flag's edges
+  // changed, so any new cycle has to pass through this flag.
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("WITH RECURSIVE reachable (id) AS ("
+                                "SELECT prerequisite_id FROM feature_flag_prerequisites WHERE flag_id = @id "
+                                "UNION "
+                                "SELECT p.prerequisite_id FROM feature_flag_prerequisites p JOIN reachable r ON p.flag_id = r.id"
+                                ") SELECT 1 FROM reachable WHERE id = @id LIMIT 1"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@id", id);
+  int result = step_done(statement);
+  if (result == SQLITE_ROW)
+    return DB_CYCLE;
+  return result == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+// Reads back the full document of flag `id`, in the shape `db_put_flag`
+// accepts.
+static struct json_object *flag_document(sqlite3 *db, int64_t id)
+{
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("SELECT f.key, f.name, COALESCE(MAX(s.enabled), 0), r.rule "
+                                "FROM feature_flags f "
+                                "LEFT JOIN feature_flag_default_state s ON s.feature_flag_id = f.id "
+                                "LEFT JOIN feature_flag_rules r ON r.feature_flag_id = f.id "
+                                "WHERE f.id = @id GROUP BY f.id"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+    return NULL;
+  bind_int64(statement, "@id", id);
+  if (sqlite3_step(statement) != SQLITE_ROW)
+  {
+    sqlite3_finalize(statement);
+    return NULL;
+  }
+
+  struct json_object *document = json_object_new_object();
+  json_object_object_add(document, "key", json_object_new_string((const char *)sqlite3_column_text(statement, 0)));
+  json_object_object_add(document, "name", json_object_new_string((const char *)sqlite3_column_text(statement, 1)));
+  json_object_object_add(document, "enabled", json_object_new_boolean(sqlite3_column_int(statement, 2) != 0));
+  json_object_object_add(document, "rule",
+                         sqlite3_column_type(statement, 3) == SQLITE_NULL
+                             ? NULL
+                             : json_tokener_parse((const char *)sqlite3_column_text(statement, 3)));
+  sqlite3_finalize(statement);
+
+  struct json_object *prerequisites = json_object_new_array();
+  json_object_object_add(document, "prerequisites", prerequisites);
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("SELECT f.key FROM feature_flag_prerequisites p "
+                                "JOIN feature_flags f ON f.id = p.prerequisite_id "
+                                "WHERE p.flag_id = @id ORDER BY f.key"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+  {
+    json_object_put(document);
+    return NULL;
+  }
+  bind_int64(statement, "@id", id);
+  int result = 0;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+    json_object_array_add(prerequisites, json_object_new_string((const char *)sqlite3_column_text(statement, 0)));
+  sqlite3_finalize(statement);
+  if (result != SQLITE_DONE)
+  {
+    json_object_put(document);
+    return NULL;
+  }
+  return document;
+}
+
+static int log_flag_change(sqlite3 *db, int64_t id)
+{
+  sqlite3_stmt *statement = NULL;
+  struct json_object *document = flag_document(db, id);
+  if (document == NULL)
+    return DB_ERROR;
+
+  if (sqlite3_prepare_v2(db, STRLIT("INSERT INTO flag_changes (flag_id, document) VALUES (@id, @document)"), &statement, NULL) != SQLITE_OK)
+  {
+    json_object_put(document);
+    return DB_ERROR;
+  }
+  bind_int64(statement, "@id", id);
+  bind_text(statement, "@document", json_object_to_json_string_ext(document, JSON_C_TO_STRING_PLAIN));
+  json_object_put(document);
+  return step_done(statement) == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+int db_put_flag(sqlite3 *db, struct json_object *flag, bool create)
+{
+  struct json_object *key = NULL;
+  struct json_object *field = NULL;
+  if (!json_object_is_type(flag, json_type_object) ||
+      !json_object_object_get_ex(flag, "key", &key) ||
+      !json_object_is_type(key, json_type_string) ||
+      json_object_get_string_len(key) == 0)
+    return DB_INVALID;
+
+  if (db_begin(db) != SQLITE_OK)
+    return DB_ERROR;
+
+  int64_t id = -1;
+  int result = put_flag_row(db, flag, create, &id);
+  if (result == DB_OK && json_object_object_get_ex(flag, "enabled", &field))
+    result = put_flag_state(db, id, field);
+  if (result == DB_OK && json_object_object_get_ex(flag, "rule", &field))
+    result = put_flag_rule(db, id, field);
+  if (result == DB_OK && json_object_object_get_ex(flag, "prerequisites", &field))
+    result = put_flag_prerequisites(db, id, field);
+  if (result == DB_OK)
+    result = log_flag_change(db, id);
+
+  if (result != DB_OK)
+  {
+    db_rollback(db);
+    return result;
+  }
+  return db_commit(db) == SQLITE_OK ? DB_OK : DB_ERROR;
+}
+
+struct evaluation_plan *db_load_evaluation_plan(sqlite3 *db)
+{
+  struct evaluation_plan *plan = NULL;
+  struct flag_definition *flags = NULL;
+  struct flag_prerequisite *prerequisites = NULL;
+  int n_flags = 0, n_prerequisites = 0, capacity = 0;
+  sqlite3_stmt *statement = NULL;
+  int result = 0;
+
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("SELECT f.id, f.key, COALESCE(MAX(s.enabled), 0), r.rule "
+                                "FROM feature_flags f "
+                                "LEFT JOIN feature_flag_default_state s ON s.feature_flag_id = f.id "
+                                "LEFT JOIN feature_flag_rules r ON r.feature_flag_id = f.id "
+                                "GROUP BY f.id"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+    goto done;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+  {
+    if (n_flags == capacity)
+    {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      struct flag_definition *grown = realloc(flags, capacity * sizeof(*flags));
+      if (grown == NULL)
+        goto done;
+      flags = grown;
+    }
+
+    struct flag_definition *flag = &flags[n_flags];
+    const char *key = (const char *)sqlite3_column_text(statement, 1);
+    size_t key_len = strlen(key);
+    char *key_copy = malloc(key_len + 1);
+    if (key_copy == NULL)
+      goto done;
+    memcpy(key_copy, key, key_len + 1);
+
+    flag->id = sqlite3_column_int64(statement, 0);
+    flag->key = key_copy;
+    flag->enabled = sqlite3_column_int(statement, 2) != 0;
+    flag->rule = sqlite3_column_type(statement, 3) == SQLITE_NULL
+                     ? NULL
+                     : json_tokener_parse((const char *)sqlite3_column_text(statement, 3));
+    n_flags++;
+  }
+  if (result != SQLITE_DONE)
+    goto done;
+  sqlite3_finalize(statement);
+  statement = NULL;
+
+  capacity = 0;
+  if (sqlite3_prepare_v2(db, STRLIT("SELECT flag_id, prerequisite_id FROM feature_flag_prerequisites"), &statement, NULL) != SQLITE_OK)
+    goto done;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+  {
+    if (n_prerequisites == capacity)
+    {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      struct flag_prerequisite *grown = realloc(prerequisites, capacity * sizeof(*prerequisites));
+      if (grown == NULL)
+        goto done;
+      prerequisites = grown;
+    }
+    prerequisites[n_prerequisites].flag_id = sqlite3_column_int64(statement, 0);
+    prerequisites[n_prerequisites].prerequisite_id = sqlite3_column_int64(statement, 1);
+    n_prerequisites++;
+  }
+  if (result != SQLITE_DONE)
+    goto done;
+
+  plan = compile_evaluation_plan(flags, n_flags, prerequisites, n_prerequisites);
+  if (plan == NULL)
+    fprintf(stderr, "failed to compile evaluation plan\n");
+
+done:
+  sqlite3_finalize(statement);
+  for (int k = 0; k < n_flags; k++)
+  {
+    free((char *)flags[k].key);
+    if (flags[k].rule != NULL)
+      json_object_put(flags[k].rule);
+  }
+  free(flags);
+  free(prerequisites);
+  return plan;
+}
+
+int db_changes_since(sqlite3 *db, int64_t since, int limit, struct json_object **changes)
+{
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         STRLIT("SELECT version, document FROM flag_changes "
+                                "WHERE version > @since ORDER BY version LIMIT @limit"),
+                         &statement,
+                         NULL) != SQLITE_OK)
+    return DB_ERROR;
+  bind_int64(statement, "@since", since);
+  bind_int64(statement, "@limit", limit);
+
+  *changes = json_object_new_array();
+  int result = 0;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+  {
+    struct json_object *change = json_object_new_object();
+    json_object_object_add(change, "version", json_object_new_int64(sqlite3_column_int64(statement, 0)));
+    json_object_object_add(change, "flag", json_tokener_parse((const char *)sqlite3_column_text(statement, 1)));
+    json_object_array_add(*changes, change);
+  }
+  sqlite3_finalize(statement);
+
+  if (result != SQLITE_DONE)
+  {
+    json_object_put(*changes);
+    *changes = NULL;
+    return DB_ERROR;
+  }
+  return DB_OK;
+}
@@ -2,10 +2,20 @@
 #define DB_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "sqlite3.h"
 
 struct json_object;
+struct evaluation_plan;
+
+// Results of flag writes.
+#define DB_OK 0
+#define DB_ERROR 1
+#define DB_INVALID 2
+#define DB_CONFLICT 3
+#define DB_NOT_FOUND 4
+#define DB_CYCLE 5
 
 int initialize_db(sqlite3 **db);
 int close_db(sqlite3 **db);
@@ -13,12 +23,50 @@ int close_db(sqlite3 **db);
 // Initialize the database but keep everything in memory. Useful for tests.
 int initialize_db_mem(sqlite3 **db);
 
+// Call `observer` with the SQL of every statement as it starts running.
+void db_observe_statements(void (*observer)(const char *sql));
+
 // Database stuff
 int migrate(sqlite3 *db);
 int db_begin(sqlite3 *db);
 int db_commit(sqlite3 *db);
+int db_rollback(sqlite3 *db);
+
+// Granularity of the last-seen timestamps on observed context keys and values.
+#define CONTEXT_BUCKET_SECONDS 3600
 
 // Record metrics about the request's context in the database.
 bool record_context_metrics(sqlite3 *db, struct json_object *context);
+bool record_context_metrics_at(sqlite3 *db, struct json_object *context, int64_t now);
+
+// Delete up to `limit` observed context values last seen more than
+// `value_ttl` seconds before `now`, then keys older than `key_ttl` that have
+// no values left and no flag bound to them. A TTL of 0 keeps rows forever.
+// Returns the number of rows deleted or -1 on error.
+int db_purge_context_metrics(sqlite3 *db, int64_t now, int64_t key_ttl, int64_t value_ttl, int limit);
+
+// Return up to `pages` free pages to the filesystem.
+int db_incremental_vacuum(sqlite3 *db, int pages);
+
+// Create (`create == true`) or update a flag from its JSON document:
+//
+//   { "key": "checkout-v3", "name": "...", "enabled": true,
+//     "rule": { "country": ["US", "CA"] }, "prerequisites": ["checkout-v2"] }
+//
+// Only `key` is required. Fields left out of an update are kept as they are.
+// Writes that would make the prerequisites cyclic are rolled back and return
+// DB_CYCLE.
+int db_put_flag(sqlite3 *db, struct json_object *flag, bool create);
+
+// Every successful `db_put_flag` appends the flag's full document to a change
+// log under a new, monotonically increasing version. Sets `*changes` to an
+// array of up to `limit` `{ "version": ..., "flag": { ... } }` entries newer
+// than `since`, oldest first. Applying them in order with `db_put_flag`
+// reproduces the flags.
+int db_changes_since(sqlite3 *db, int64_t since, int limit, struct json_object **changes);
+
+// Load every flag with its rule and prerequisites and compile them into an
+// evaluation plan. Returns NULL on failure.
+struct evaluation_plan *db_load_evaluation_plan(sqlite3 *db);
 
 #endif // DB_H_
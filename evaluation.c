@@ -1,6 +1,8 @@
 #include "evaluation.h"
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "json-c/json.h"
 
@@ -34,7 +36,20 @@ bool is_valid_rule(struct json_object *proposed_rule)
   return true;
 }
 
-bool matches_rule(struct json_object *rule_set, struct json_object *provided_set)
+// Appends what was checked for `key` to `explain`. `scanned` is the length of
+// the array scanned for array-based rules, and -1 otherwise.
+static void explain_key(struct json_object *explain, const char *key, int scanned, bool matched)
+{
+  struct json_object *entry = json_object_new_object();
+  json_object_object_add(entry, "key", json_object_new_string(key));
+  if (scanned >= 0)
+    json_object_object_add(entry, "scanned", json_object_new_int(scanned));
+  json_object_object_add(entry, "matched", json_object_new_boolean(matched));
+  json_object_array_add(explain, entry);
+}
+
+// `matches_rule`, optionally recording each key checked into `explain`.
+static bool match_rule(struct json_object *rule_set, struct json_object *provided_set, struct json_object *explain)
 {
   struct json_object *current_val = NULL;
 
@@ -48,22 +63,333 @@ bool matches_rule(struct json_object *rule_set, struct json_object *provided_set
     if (json_object_is_type(entry_val, json_type_array))
     {
       bool found = false;
-      for (int k = 0; k < json_object_array_length(entry_val); k++)
+      int k = 0;
+      for (; k < json_object_array_length(entry_val); k++)
       {
         struct json_object *current_iter = json_object_array_get_idx(entry_val, k);
         if (json_object_is_type(current_iter, json_type_array) || json_object_is_type(current_iter, json_type_object))
           return false;
         found |= json_object_equal(current_iter, current_val);
       }
+      if (explain != NULL)
+        explain_key(explain, entry_key, k, found);
       if (!found)
         return false;
+      n_keys_checked++;
       continue;
     }
 
-    if (!json_object_equal(entry_val, current_val))
+    bool equal = json_object_equal(entry_val, current_val);
+    if (explain != NULL)
+      explain_key(explain, entry_key, -1, equal);
+    if (!equal)
       return false;
     n_keys_checked++;
   }
 
   return n_keys_checked > 0;
 }
+
+bool matches_rule(struct json_object *rule_set, struct json_object *provided_set)
+{
+  return match_rule(rule_set, provided_set, NULL);
+}
+
+
+struct id_index
+{
+  int64_t id;
+  int index;
+};
+
+static int compare_id_index(const void *a, const void *b)
+{
+  int64_t x = ((const struct id_index *)a)->id;
+  int64_t y = ((const struct id_index *)b)->id;
+  return (x > y) - (x < y);
+}
+
+static int lookup_index(const struct id_index *ids, int n, int64_t id)
+{
+  struct id_index needle = {id, -1};
+  struct id_index *found = bsearch(&needle, ids, n, sizeof(*ids), compare_id_index);
+  return found == NULL ? -1 : found->index;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+// qsort has no context argument, so `by_key` is sorted as pairs that carry
+// their own key.
+struct key_index
+{
+  const char *key;
+  int index;
+};
+
+static int compare_key_index(const void *a, const void *b)
+{
+  return strcmp(((const struct key_index *)a)->key, ((const struct key_index *)b)->key);
+}
+
+struct evaluation_plan *compile_evaluation_plan(const struct flag_definition *flags, int n_flags,
+                                                const struct flag_prerequisite *prerequisites, int n_prerequisites)
+{
+  struct evaluation_plan *plan = NULL;
+  struct id_index *ids = calloc(n_flags + 1, sizeof(*ids));
+  int *edges_from = calloc(n_prerequisites + 1, sizeof(int));
+  int *edges_to = calloc(n_prerequisites + 1, sizeof(int));
+  // Edges by node, compressed: `out_edges[out_offsets[k]..out_offsets[k + 1]]`
+  // are the dependents of `k`, `in_edges` likewise its prerequisites.
+  int *out_offsets = calloc(n_flags + 2, sizeof(int));
+  int *in_offsets = calloc(n_flags + 2, sizeof(int));
+  int *out_edges = calloc(n_prerequisites + 1, sizeof(int));
+  int *in_edges = calloc(n_prerequisites + 1, sizeof(int));
+  int *cursor = calloc(n_flags + 1, sizeof(int));
+  int *n_pending = calloc(n_flags + 1, sizeof(int));
+  int *order = calloc(n_flags + 1, sizeof(int));
+  int *position = calloc(n_flags + 1, sizeof(int));
+  int *seen = calloc(n_flags + 1, sizeof(int));
+  struct key_index *keys = calloc(n_flags + 1, sizeof(*keys));
+  if (ids == NULL || edges_from == NULL || edges_to == NULL || out_offsets == NULL || in_offsets == NULL ||
+      out_edges == NULL || in_edges == NULL || cursor == NULL || n_pending == NULL ||
+      order == NULL || position == NULL || seen == NULL || keys == NULL)
+    goto done;
+
+  for (int k = 0; k < n_flags; k++)
+  {
+    ids[k].id = flags[k].id;
+    ids[k].index = k;
+  }
+  qsort(ids, n_flags, sizeof(*ids), compare_id_index);
+
+  // Edges point from a prerequisite to the flag that depends on it.
+  for (int k = 0; k < n_prerequisites; k++)
+  {
+    edges_from[k] = lookup_index(ids, n_flags, prerequisites[k].prerequisite_id);
+    edges_to[k] = lookup_index(ids, n_flags, prerequisites[k].flag_id);
+    if (edges_from[k] < 0 || edges_to[k] < 0)
+      goto done;
+    n_pending[edges_to[k]]++;
+    out_offsets[edges_from[k] + 1]++;
+    in_offsets[edges_to[k] + 1]++;
+  }
+  for (int k = 0; k < n_flags; k++)
+  {
+    out_offsets[k + 1] += out_offsets[k];
+    in_offsets[k + 1] += in_offsets[k];
+  }
+  memcpy(cursor, out_offsets, n_flags * sizeof(int));
+  for (int k = 0; k < n_prerequisites; k++)
+    out_edges[cursor[edges_from[k]]++] = edges_to[k];
+  memcpy(cursor, in_offsets, n_flags * sizeof(int));
+  for (int k = 0; k < n_prerequisites; k++)
+    in_edges[cursor[edges_to[k]]++] = edges_from[k];
+
+  // Kahn's algorithm; `order` doubles as the queue.
+  int head = 0, tail = 0;
+  for (int k = 0; k < n_flags; k++)
+    if (n_pending[k] == 0)
+      order[tail++] = k;
+  while (head < tail)
+  {
+    int current = order[head++];
+    for (int e = out_offsets[current]; e < out_offsets[current + 1]; e++)
+      if (--n_pending[out_edges[e]] == 0)
+        order[tail++] = out_edges[e];
+  }
+  if (tail != n_flags)
+    goto done;
+
+  for (int k = 0; k < n_flags; k++)
+    position[order[k]] = k;
+
+  plan = calloc(1, sizeof(*plan));
+  if (plan == NULL)
+    goto done;
+  plan->n_steps = n_flags;
+  plan->steps = calloc(n_flags + 1, sizeof(*plan->steps));
+  plan->by_key = calloc(n_flags + 1, sizeof(int));
+  if (plan->steps == NULL || plan->by_key == NULL)
+    goto fail;
+
+  for (int k = 0; k < n_flags; k++)
+  {
+    const struct flag_definition *flag = &flags[order[k]];
+    struct plan_step *step = &plan->steps[k];
+    size_t key_len = strlen(flag->key);
+
+    step->id = flag->id;
+    step->enabled = flag->enabled;
+    step->rule = flag->rule == NULL ? NULL : json_object_get(flag->rule);
+    step->key = malloc(key_len + 1);
+    if (step->key == NULL)
+      goto fail;
+    memcpy(step->key, flag->key, key_len + 1);
+
+    step->n_prerequisites = in_offsets[order[k] + 1] - in_offsets[order[k]];
+    step->prerequisites = calloc(step->n_prerequisites + 1, sizeof(int));
+    if (step->prerequisites == NULL)
+      goto fail;
+    for (int p = 0; p < step->n_prerequisites; p++)
+      step->prerequisites[p] = position[in_edges[in_offsets[order[k]] + p]];
+  }
+
+  // Every prerequisite precedes its dependents, so a step's closure is the
+  // union of its prerequisites' closures plus itself. `seen` is stamped with
+  // the step index to deduplicate without clearing it between steps.
+  for (int k = 0; k < n_flags; k++)
+    seen[k] = -1;
+  for (int k = 0; k < n_flags; k++)
+  {
+    struct plan_step *step = &plan->steps[k];
+    int capacity = 1;
+    for (int p = 0; p < step->n_prerequisites; p++)
+      capacity += plan->steps[step->prerequisites[p]].n_closure;
+    step->closure = calloc(capacity, sizeof(int));
+    if (step->closure == NULL)
+      goto fail;
+
+    for (int p = 0; p < step->n_prerequisites; p++)
+    {
+      const struct plan_step *prerequisite = &plan->steps[step->prerequisites[p]];
+      for (int c = 0; c < prerequisite->n_closure; c++)
+      {
+        int index = prerequisite->closure[c];
+        if (seen[index] == k)
+          continue;
+        seen[index] = k;
+        step->closure[step->n_closure++] = index;
+      }
+    }
+    step->closure[step->n_closure++] = k;
+    qsort(step->closure, step->n_closure, sizeof(int), compare_int);
+  }
+
+  for (int k = 0; k < n_flags; k++)
+  {
+    keys[k].key = plan->steps[k].key;
+    keys[k].index = k;
+  }
+  qsort(keys, n_flags, sizeof(*keys), compare_key_index);
+  for (int k = 0; k < n_flags; k++)
+    plan->by_key[k] = keys[k].index;
+  goto done;
+
+fail:
+  free_evaluation_plan(plan);
+  plan = NULL;
+done:
+  free(ids);
+  free(edges_from);
+  free(edges_to);
+  free(out_offsets);
+  free(in_offsets);
+  free(out_edges);
+  free(in_edges);
+  free(cursor);
+  free(n_pending);
+  free(order);
+  free(position);
+  free(seen);
+  free(keys);
+  return plan;
+}
+
+void free_evaluation_plan(struct evaluation_plan *plan)
+{
+  if (plan == NULL)
+    return;
+  for (int k = 0; plan->steps != NULL && k < plan->n_steps; k++)
+  {
+    struct plan_step *step = &plan->steps[k];
+    if (step->rule != NULL)
+      json_object_put(step->rule);
+    free(step->key);
+    free(step->prerequisites);
+    free(step->closure);
+  }
+  free(plan->steps);
+  free(plan->by_key);
+  free(plan);
+}
+
+int find_plan_step(const struct evaluation_plan *plan, const char *key)
+{
+  int low = 0, high = plan->n_steps - 1;
+  while (low <= high)
+  {
+    int mid = low + (high - low) / 2;
+    int cmp = strcmp(plan->steps[plan->by_key[mid]].key, key);
+    if (cmp == 0)
+      return plan->by_key[mid];
+    if (cmp < 0)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return -1;
+}
+
+static bool evaluate_step(const struct evaluation_plan *plan, int index, struct json_object *context, const bool *results,
+                          struct json_object *explain)
+{
+  const struct plan_step *step = &plan->steps[index];
+  bool prerequisites_met = true;
+  for (int p = 0; p < step->n_prerequisites && prerequisites_met; p++)
+    prerequisites_met = results[step->prerequisites[p]];
+
+  struct json_object *checks = NULL;
+  bool result = false;
+  if (prerequisites_met)
+  {
+    if (step->rule != NULL && explain != NULL)
+      checks = json_object_new_array();
+    result = step->rule == NULL ? step->enabled : match_rule(step->rule, context, checks);
+  }
+
+  if (explain != NULL)
+  {
+    struct json_object *entry = json_object_new_object();
+    json_object_object_add(entry, "flag", json_object_new_string(step->key));
+    json_object_object_add(entry, "prerequisites_met", json_object_new_boolean(prerequisites_met));
+    if (step->rule == NULL)
+      json_object_object_add(entry, "default", json_object_new_boolean(step->enabled));
+    else
+      json_object_object_add(entry, "rule", checks);
+    json_object_object_add(entry, "result", json_object_new_boolean(result));
+    json_object_array_add(explain, entry);
+  }
+  return result;
+}
+
+bool evaluate_plan(const struct evaluation_plan *plan, int target, struct json_object *context, bool *results)
+{
+  const struct plan_step *step = &plan->steps[target];
+  for (int c = 0; c < step->n_closure; c++)
+  {
+    int index = step->closure[c];
+    results[index] = evaluate_step(plan, index, context, results, NULL);
+  }
+  return results[target];
+}
+
+void evaluate_plan_all(const struct evaluation_plan *plan, struct json_object *context, bool *results)
+{
+  for (int k = 0; k < plan->n_steps; k++)
+    results[k] = evaluate_step(plan, k, context, results, NULL);
+}
+
+struct json_object *explain_plan(const struct evaluation_plan *plan, int target, struct json_object *context, bool *results)
+{
+  struct json_object *explain = json_object_new_array();
+  int n = target < 0 ? plan->n_steps : plan->steps[target].n_closure;
+  for (int k = 0; k < n; k++)
+  {
+    int index = target < 0 ? k : plan->steps[target].closure[k];
+    results[index] = evaluate_step(plan, index, context, results, explain);
+  }
+  return explain;
+}
@@ -2,6 +2,7 @@
 #define EVALUATION_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct json_object;
 
@@ -17,4 +18,76 @@ bool is_valid_context(struct json_object *context);
 // with depth > 1 is rejected and returns `false`.
 bool matches_rule(struct json_object *rule_set, struct json_object *provided_set);
 
+// A flag as handed to `compile_evaluation_plan`.
+struct flag_definition
+{
+  int64_t id;
+  const char *key;
+  // Rule the context has to match for the flag to be on. When NULL, `enabled`
+  // is used instead.
+  struct json_object *rule;
+  bool enabled;
+};
+
+// `flag_id` is only on if `prerequisite_id` is on.
+struct flag_prerequisite
+{
+  int64_t flag_id;
+  int64_t prerequisite_id;
+};
+
+struct plan_step
+{
+  int64_t id;
+  char *key;
+  struct json_object *rule;
+  bool enabled;
+
+  // Indices of this flag's direct prerequisites. Always lower than the index
+  // of this step.
+  int n_prerequisites;
+  int *prerequisites;
+
+  // Indices of this flag and all of its transitive prerequisites, ascending,
+  // i.e. in the order they have to be evaluated.
+  int n_closure;
+  int *closure;
+};
+
+// Flags in topological order, precompiled so that evaluation is a single
+// forward pass with no recursion.
+struct evaluation_plan
+{
+  int n_steps;
+  struct plan_step *steps;
+
+  // Step indices sorted by key, for `find_plan_step`.
+  int *by_key;
+};
+
+// Topologically orders `flags` by `prerequisites` and precomputes each flag's
+// evaluation order. Returns NULL if the prerequisites form a cycle or refer to
+// a flag that isn't in `flags`. The plan takes its own references to rules and
+// copies keys.
+struct evaluation_plan *compile_evaluation_plan(const struct flag_definition *flags, int n_flags,
+                                                const struct flag_prerequisite *prerequisites, int n_prerequisites);
+void free_evaluation_plan(struct evaluation_plan *plan);
+
+// Returns the index of the step for `key`, or -1.
+int find_plan_step(const struct evaluation_plan *plan, const char *key);
+
+// Evaluates step `target` and its prerequisites against `context`, each at
+// most once. `results` needs room for `plan->n_steps` entries; only the
+// entries in the target's closure are written. Returns the target's state.
+bool evaluate_plan(const struct evaluation_plan *plan, int target, struct json_object *context, bool *results);
+
+// Evaluates every step against `context`.
+void evaluate_plan_all(const struct evaluation_plan *plan, struct json_object *context, bool *results);
+
+// Evaluates like `evaluate_plan`, or `evaluate_plan_all` if `target` is -1,
+// and returns an array describing every step: whether its prerequisites were
+// met, which rule keys were checked (and how long an array was scanned for
+// each) or which default applied, and the result.
+struct json_object *explain_plan(const struct evaluation_plan *plan, int target, struct json_object *context, bool *results);
+
 #endif // EVALUATION_H_
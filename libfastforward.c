@@ -0,0 +1,486 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "libfastforward.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json-c/json.h"
+#include "evaluation.h"
+
+// Plans with up to this many flags are evaluated with results on the stack.
+#define FF_STACK_RESULTS 1024
+
+struct ff_client
+{
+  // Serializes writers. Only writers touch `flags`.
+  pthread_mutex_t write_lock;
+  // Swapped atomically by writers, which free the previous plan once no
+  // reader can still be using it; see `wait_for_readers`.
+  struct evaluation_plan *plan;
+  // Flag documents by key, in the shape the server logs them. Documents are
+  // never modified once added, so snapshots share them.
+  struct json_object *flags;
+  int64_t version;
+};
+
+struct ff_context
+{
+  struct json_object *object;
+};
+
+// One per thread that has evaluated, on its own cache line so that readers
+// never write to memory shared with each other. `sequence` is odd while the
+// thread is evaluating. Slots are never freed; a thread's slot is reused by
+// a later thread once it exits.
+struct reader_slot
+{
+  uint64_t sequence;
+  bool in_use;
+  // Results for plans too large for the stack, kept between evaluations.
+  bool *results;
+  int results_capacity;
+  struct reader_slot *next;
+} __attribute__((aligned(64)));
+
+// Only ever pushed onto, under `readers_lock`.
+static struct reader_slot *readers = NULL;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static __thread struct reader_slot *this_reader = NULL;
+
+static void release_reader(void *_slot)
+{
+  struct reader_slot *slot = _slot;
+  __atomic_store_n(&slot->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+  pthread_key_create(&reader_key, release_reader);
+}
+
+static struct reader_slot *register_reader(void)
+{
+  struct reader_slot *slot = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+  for (; slot != NULL; slot = slot->next)
+  {
+    bool unused = false;
+    if (__atomic_compare_exchange_n(&slot->in_use, &unused, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (slot == NULL)
+  {
+    void *memory = NULL;
+    if (posix_memalign(&memory, sizeof(struct reader_slot), sizeof(struct reader_slot)) != 0)
+      return NULL;
+    slot = memory;
+    memset(slot, 0, sizeof(*slot));
+    slot->in_use = true;
+    pthread_mutex_lock(&readers_lock);
+    slot->next = readers;
+    __atomic_store_n(&readers, slot, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&readers_lock);
+  }
+
+  pthread_once(&reader_key_once, create_reader_key);
+  pthread_setspecific(reader_key, slot);
+  return this_reader = slot;
+}
+
+// Waits until every reader that may have loaded a plan before the caller
+// swapped it out has finished evaluating.
+static void wait_for_readers(void)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (struct reader_slot *slot = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next)
+  {
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (sequence % 2 == 0)
+      continue;
+    while (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == sequence)
+      sched_yield();
+  }
+}
+
+int ff_api_version(void)
+{
+  return FF_API_VERSION;
+}
+
+ff_client *ff_client_new(void)
+{
+  ff_client *client = calloc(1, sizeof(*client));
+  if (client == NULL)
+    return NULL;
+  if ((client->flags = json_object_new_object()) == NULL ||
+      (client->plan = compile_evaluation_plan(NULL, 0, NULL, 0)) == NULL)
+  {
+    json_object_put(client->flags);
+    free(client);
+    return NULL;
+  }
+  pthread_mutex_init(&client->write_lock, NULL);
+  return client;
+}
+
+void ff_client_free(ff_client *client)
+{
+  if (client == NULL)
+    return;
+  free_evaluation_plan(client->plan);
+  json_object_put(client->flags);
+  pthread_mutex_destroy(&client->write_lock);
+  free(client);
+}
+
+// The server stores keys with spaces replaced by dashes.
+static struct json_object *normalized_key(struct json_object *key)
+{
+  size_t len = json_object_get_string_len(key);
+  char *chars = malloc(len + 1);
+  if (chars == NULL)
+    return NULL;
+  memcpy(chars, json_object_get_string(key), len + 1);
+  for (size_t k = 0; k < len; k++)
+    if (chars[k] == ' ')
+      chars[k] = '-';
+  struct json_object *normalized = json_object_new_string_len(chars, (int)len);
+  free(chars);
+  return normalized;
+}
+
+// Field `name` of `flag` if present, else of `previous`, else `fallback`.
+static struct json_object *updated_field(struct json_object *flag, struct json_object *previous, const char *name, struct json_object *fallback)
+{
+  struct json_object *field = NULL;
+  if (json_object_object_get_ex(flag, name, &field) || (previous != NULL && json_object_object_get_ex(previous, name, &field)))
+  {
+    json_object_put(fallback);
+    return json_object_get(field);
+  }
+  return fallback;
+}
+
+// Adds or replaces the document of one flag in `flags`, validated the way
+// `db_put_flag` validates it. Whether prerequisites exist and are acyclic is
+// checked when `flags` is compiled.
+static int put_document(struct json_object *flags, struct json_object *flag)
+{
+  struct json_object *key = NULL;
+  struct json_object *field = NULL;
+  if (!json_object_is_type(flag, json_type_object) ||
+      !json_object_object_get_ex(flag, "key", &key) ||
+      !json_object_is_type(key, json_type_string) ||
+      json_object_get_string_len(key) == 0)
+    return FF_INVALID;
+  if (json_object_object_get_ex(flag, "name", &field) && !json_object_is_type(field, json_type_string))
+    return FF_INVALID;
+  if (json_object_object_get_ex(flag, "enabled", &field) && !json_object_is_type(field, json_type_boolean))
+    return FF_INVALID;
+  if (json_object_object_get_ex(flag, "rule", &field) && field != NULL &&
+      (!json_object_is_type(field, json_type_object) || !is_valid_rule(field)))
+    return FF_INVALID;
+
+  struct json_object *prerequisites = NULL;
+  if (json_object_object_get_ex(flag, "prerequisites", &field))
+  {
+    if (!json_object_is_type(field, json_type_array))
+      return FF_INVALID;
+    prerequisites = json_object_new_array();
+    for (size_t k = 0; k < json_object_array_length(field); k++)
+    {
+      struct json_object *prerequisite = json_object_array_get_idx(field, k);
+      if (!json_object_is_type(prerequisite, json_type_string))
+      {
+        json_object_put(prerequisites);
+        return FF_INVALID;
+      }
+      json_object_array_add(prerequisites, normalized_key(prerequisite));
+    }
+  }
+
+  struct json_object *document = json_object_new_object();
+  struct json_object *normalized = normalized_key(key);
+  const char *document_key = json_object_get_string(normalized);
+  struct json_object *previous = json_object_object_get(flags, document_key);
+  json_object_object_add(document, "key", normalized);
+  json_object_object_add(document, "enabled", updated_field(flag, previous, "enabled", json_object_new_boolean(false)));
+  json_object_object_add(document, "rule", updated_field(flag, previous, "rule", NULL));
+  json_object_object_add(document, "prerequisites",
+                         prerequisites != NULL ? prerequisites : updated_field(flag, previous, "prerequisites", json_object_new_array()));
+  json_object_object_add(flags, document_key, document);
+  return FF_OK;
+}
+
+// Compiles every document in `flags`. Flag ids are positions in `flags`.
+static int compile_flags(struct json_object *flags, struct evaluation_plan **plan)
+{
+  int n_flags = json_object_object_length(flags);
+  int n_prerequisites = 0;
+  struct flag_definition *definitions = calloc(n_flags + 1, sizeof(*definitions));
+  struct json_object *ids = json_object_new_object();
+  int result = FF_ERROR;
+  if (definitions == NULL || ids == NULL)
+    goto done;
+
+  int k = 0;
+  json_object_object_foreach(flags, key, document)
+  {
+    definitions[k].id = k;
+    definitions[k].key = key;
+    definitions[k].enabled = json_object_get_boolean(json_object_object_get(document, "enabled"));
+    definitions[k].rule = json_object_object_get(document, "rule");
+    n_prerequisites += json_object_array_length(json_object_object_get(document, "prerequisites"));
+    json_object_object_add(ids, key, json_object_new_int(k));
+    k++;
+  }
+
+  struct flag_prerequisite *prerequisites = calloc(n_prerequisites + 1, sizeof(*prerequisites));
+  if (prerequisites == NULL)
+    goto done;
+  n_prerequisites = 0;
+  result = FF_INVALID;
+  for (k = 0; k < n_flags; k++)
+  {
+    struct json_object *keys = json_object_object_get(json_object_object_get(flags, definitions[k].key), "prerequisites");
+    for (size_t p = 0; p < json_object_array_length(keys); p++)
+    {
+      struct json_object *id = NULL;
+      if (!json_object_object_get_ex(ids, json_object_get_string(json_object_array_get_idx(keys, p)), &id))
+        goto prerequisites_done;
+      prerequisites[n_prerequisites].flag_id = k;
+      prerequisites[n_prerequisites].prerequisite_id = json_object_get_int(id);
+      n_prerequisites++;
+    }
+  }
+
+  // Every prerequisite exists, so the only way to fail is a cycle.
+  *plan = compile_evaluation_plan(definitions, n_flags, prerequisites, n_prerequisites);
+  result = *plan != NULL ? FF_OK : FF_CYCLE;
+
+prerequisites_done:
+  free(prerequisites);
+done:
+  free(definitions);
+  json_object_put(ids);
+  return result;
+}
+
+// A copy of `flags` sharing its documents.
+static struct json_object *copy_flags(struct json_object *flags)
+{
+  struct json_object *copy = json_object_new_object();
+  if (copy == NULL)
+    return NULL;
+  json_object_object_foreach(flags, key, document)
+    json_object_object_add(copy, key, json_object_get(document));
+  return copy;
+}
+
+// Applies `documents`, one flag document or an array of them, to a copy of
+// the client's flags (or to no flags at all with `replace`) and swaps the
+// result in if it compiles. Array elements are unwrapped with `field` when it
+// is set. Changes with a version of at most `*version` are skipped, and
+// `*version` is advanced past the ones applied.
+static int write_flags(ff_client *client, struct json_object *documents, bool replace, const char *field, int64_t *version)
+{
+  if (documents == NULL)
+    return FF_INVALID;
+
+  pthread_mutex_lock(&client->write_lock);
+  struct evaluation_plan *plan = NULL;
+  struct json_object *flags = replace ? json_object_new_object() : copy_flags(client->flags);
+  int64_t applied = version != NULL ? *version : 0;
+  int result = flags == NULL ? FF_ERROR : FF_OK;
+
+  bool is_array = json_object_is_type(documents, json_type_array);
+  size_t n_documents = is_array ? json_object_array_length(documents) : 1;
+  for (size_t k = 0; k < n_documents && result == FF_OK; k++)
+  {
+    struct json_object *document = is_array ? json_object_array_get_idx(documents, k) : documents;
+    if (field != NULL)
+    {
+      struct json_object *change_version = NULL;
+      if (!json_object_object_get_ex(document, "version", &change_version))
+      {
+        result = FF_INVALID;
+        break;
+      }
+      if (json_object_get_int64(change_version) <= applied)
+        continue;
+      applied = json_object_get_int64(change_version);
+      document = json_object_object_get(document, field);
+    }
+    result = put_document(flags, document);
+  }
+
+  if (result == FF_OK)
+    result = compile_flags(flags, &plan);
+  if (result == FF_OK)
+  {
+    struct evaluation_plan *previous = __atomic_exchange_n(&client->plan, plan, __ATOMIC_SEQ_CST);
+    wait_for_readers();
+    free_evaluation_plan(previous);
+
+    json_object_put(client->flags);
+    client->flags = flags;
+    flags = NULL;
+    if (version != NULL)
+      __atomic_store_n(version, applied, __ATOMIC_RELEASE);
+  }
+
+  json_object_put(flags);
+  pthread_mutex_unlock(&client->write_lock);
+  return result;
+}
+
+static struct json_object *parse(const char *json, size_t len)
+{
+  json_tokener *tokener = json_tokener_new();
+  if (tokener == NULL)
+    return NULL;
+  struct json_object *parsed = json_tokener_parse_ex(tokener, json, (int)len);
+  if (json_tokener_get_error(tokener) != json_tokener_success)
+  {
+    json_object_put(parsed);
+    parsed = NULL;
+  }
+  json_tokener_free(tokener);
+  return parsed;
+}
+
+int ff_load_snapshot(ff_client *client, const char *json, size_t len)
+{
+  struct json_object *documents = parse(json, len);
+  int result = json_object_is_type(documents, json_type_array) ? write_flags(client, documents, true, NULL, NULL) : FF_INVALID;
+  json_object_put(documents);
+  return result;
+}
+
+int ff_apply_update(ff_client *client, const char *json, size_t len)
+{
+  struct json_object *document = parse(json, len);
+  int result = json_object_is_type(document, json_type_object) ? write_flags(client, document, false, NULL, NULL) : FF_INVALID;
+  json_object_put(document);
+  return result;
+}
+
+int ff_apply_changes(ff_client *client, const char *json, size_t len)
+{
+  struct json_object *changes = parse(json, len);
+  int result = json_object_is_type(changes, json_type_array) ? write_flags(client, changes, false, "flag", &client->version) : FF_INVALID;
+  json_object_put(changes);
+  return result;
+}
+
+int64_t ff_version(ff_client *client)
+{
+  return __atomic_load_n(&client->version, __ATOMIC_ACQUIRE);
+}
+
+ff_context *ff_context_new(void)
+{
+  ff_context *context = malloc(sizeof(*context));
+  if (context == NULL)
+    return NULL;
+  if ((context->object = json_object_new_object()) == NULL)
+  {
+    free(context);
+    return NULL;
+  }
+  return context;
+}
+
+ff_context *ff_context_parse(const char *json, size_t len)
+{
+  struct json_object *object = parse(json, len);
+  if (!json_object_is_type(object, json_type_object) || !is_valid_context(object))
+  {
+    json_object_put(object);
+    return NULL;
+  }
+  ff_context *context = malloc(sizeof(*context));
+  if (context == NULL)
+  {
+    json_object_put(object);
+    return NULL;
+  }
+  context->object = object;
+  return context;
+}
+
+static int set(ff_context *context, const char *key, struct json_object *value)
+{
+  if (value == NULL)
+    return FF_ERROR;
+  return json_object_object_add(context->object, key, value) == 0 ? FF_OK : FF_ERROR;
+}
+
+int ff_context_set_string(ff_context *context, const char *key, const char *value)
+{
+  return set(context, key, json_object_new_string(value));
+}
+
+int ff_context_set_int(ff_context *context, const char *key, int64_t value)
+{
+  return set(context, key, json_object_new_int64(value));
+}
+
+int ff_context_set_double(ff_context *context, const char *key, double value)
+{
+  return set(context, key, json_object_new_double(value));
+}
+
+int ff_context_set_bool(ff_context *context, const char *key, int value)
+{
+  return set(context, key, json_object_new_boolean(value != 0));
+}
+
+void ff_context_free(ff_context *context)
+{
+  if (context == NULL)
+    return;
+  json_object_put(context->object);
+  free(context);
+}
+
+int ff_evaluate(ff_client *client, const char *key, const ff_context *context)
+{
+  struct json_object *object = context != NULL ? context->object : NULL;
+  struct reader_slot *slot = this_reader != NULL ? this_reader : register_reader();
+  if (slot == NULL)
+    return -1;
+
+  // Announce the read before loading the plan, so that a writer swapping it
+  // either sees this reader or is seen by it.
+  __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  const struct evaluation_plan *plan = __atomic_load_n(&client->plan, __ATOMIC_ACQUIRE);
+
+  int result = -1;
+  int target = find_plan_step(plan, key);
+  if (target >= 0 && plan->n_steps <= FF_STACK_RESULTS)
+  {
+    bool results[FF_STACK_RESULTS];
+    result = evaluate_plan(plan, target, object, results);
+  }
+  else if (target >= 0)
+  {
+    if (slot->results_capacity < plan->n_steps)
+    {
+      free(slot->results);
+      slot->results = malloc(plan->n_steps * sizeof(bool));
+      slot->results_capacity = slot->results == NULL ? 0 : plan->n_steps;
+    }
+    if (slot->results != NULL)
+      result = evaluate_plan(plan, target, object, slot->results);
+  }
+
+  __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+  return result;
+}
@@ -0,0 +1,79 @@
+#ifndef LIBFASTFORWARD_H_
+#define LIBFASTFORWARD_H_
+
+// In-process flag evaluation with the same semantics as the fastforward
+// server. Flags are described by the documents the server's `/flag`
+// endpoint accepts and its `/changes` endpoint serves:
+//
+//   { "key": "checkout-v3", "name": "...", "enabled": true,
+//     "rule": { "country": ["US", "CA"] }, "prerequisites": ["checkout-v2"] }
+//
+// A client keeps an immutable compiled snapshot of its flags. Any number of
+// threads may call `ff_evaluate` concurrently with each other and with
+// writers; writes are serialized and swap in a new snapshot only once it is
+// complete, so readers never see a partially applied update. Readers take
+// no lock; a write returns once no reader still uses the snapshot it replaced.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define FF_API __attribute__((visibility("default")))
+#else
+#define FF_API
+#endif
+
+// Bumped on incompatible changes to this header.
+#define FF_API_VERSION 1
+
+// Results of writes. They match the server's DB_* codes.
+#define FF_OK 0
+#define FF_ERROR 1
+#define FF_INVALID 2
+#define FF_NOT_FOUND 4
+#define FF_CYCLE 5
+
+typedef struct ff_client ff_client;
+typedef struct ff_context ff_context;
+
+FF_API int ff_api_version(void);
+
+// A client with no flags. Returns NULL when out of memory.
+FF_API ff_client *ff_client_new(void);
+FF_API void ff_client_free(ff_client *client);
+
+// Replace every flag with the JSON array of flag documents in `json`.
+// Prerequisites may refer to flags later in the array.
+FF_API int ff_load_snapshot(ff_client *client, const char *json, size_t len);
+
+// Create or update one flag from its document. Fields left out of an update
+// are kept as they are.
+FF_API int ff_apply_update(ff_client *client, const char *json, size_t len);
+
+// Apply a response body of the server's `/changes` endpoint, an array of
+// `{ "version": ..., "flag": { ... } }`, all or nothing. Changes at or below
+// `ff_version` are skipped, so batches can be replayed safely.
+FF_API int ff_apply_changes(ff_client *client, const char *json, size_t len);
+
+// Version of the last change applied with `ff_apply_changes`, to poll
+// `/changes?since=` with.
+FF_API int64_t ff_version(ff_client *client);
+
+// Contexts are flat maps of strings, numbers and booleans. A context may be
+// reused for any number of evaluations, but only by one thread at a time.
+FF_API ff_context *ff_context_new(void);
+
+// Parse a context from a JSON object. Returns NULL if it isn't a valid
+// context.
+FF_API ff_context *ff_context_parse(const char *json, size_t len);
+FF_API int ff_context_set_string(ff_context *context, const char *key, const char *value);
+FF_API int ff_context_set_int(ff_context *context, const char *key, int64_t value);
+FF_API int ff_context_set_double(ff_context *context, const char *key, double value);
+FF_API int ff_context_set_bool(ff_context *context, const char *key, int value);
+FF_API void ff_context_free(ff_context *context);
+
+// Returns 1 if flag `key` is on for `context`, 0 if it is off and -1 if there
+// is no such flag.
+FF_API int ff_evaluate(ff_client *client, const char *key, const ff_context *context);
+
+#endif // LIBFASTFORWARD_H_
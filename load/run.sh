@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Runs the k6 load suite against a locally started server with a freshly
+# seeded SQLite file.
+#
+#   BIN       server binary (default ./fastforward)
+#   CPUS      cpu list the server is pinned to (default 0,1, i.e. the 2 vCPU
+#             profile we deploy on)
+#   LABEL     name of the report written to load/results/LABEL.json
+#   BASELINE  optional earlier report to diff against
+#
+# Any remaining environment (RATE, DURATION, READ_RATIO) is passed to k6.
+
+set -e
+
+BIN=${BIN:-./fastforward}
+CPUS=${CPUS:-0,1}
+LABEL=${LABEL:-$(git rev-parse --short HEAD 2>/dev/null || echo local)}
+SQLITE=${SQLITE:-$(command -v sqlite3 || echo libsqlite/bin/sqlite3)}
+WORKDIR=$(mktemp -d)
+DB="$WORKDIR/load.db"
+
+cleanup() {
+  [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+  rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+start_server() {
+  FF_DB_PATH="$DB" taskset -c "$CPUS" "$BIN" >"$WORKDIR/server.log" 2>&1 &
+  SERVER_PID=$!
+  for _ in $(seq 50); do
+    curl -fs http://localhost:7890/ping >/dev/null 2>&1 && return 0
+    sleep 0.1
+  done
+  echo "server did not come up, see log:" >&2
+  cat "$WORKDIR/server.log" >&2
+  exit 1
+}
+
+stop_server() {
+  kill "$SERVER_PID"
+  wait "$SERVER_PID" 2>/dev/null || true
+  SERVER_PID=
+}
+
+# Let the server run its migrations, then seed while it is down so that
+# nothing it caches at startup is stale.
+start_server
+stop_server
+"$SQLITE" "$DB" <load/seed.sql
+start_server
+
+[ -n "$BASELINE" ] && BASELINE=$(realpath "$BASELINE")
+
+mkdir -p load/results
+k6 run \
+  -e LABEL="$LABEL" \
+  -e BASELINE="${BASELINE:-}" \
+  -e CPUS="$CPUS" \
+  load/suite.js
@@ -0,0 +1,40 @@
+-- Seed data for the load suite. Applied to a database whose schema has
+-- already been created by the server's own migrations.
+BEGIN;
+
+DELETE FROM feature_flag_prerequisites;
+DELETE FROM feature_flag_rules;
+DELETE FROM feature_flag_default_state;
+DELETE FROM flags_meta;
+DELETE FROM feature_flags;
+DELETE FROM request_meta_values;
+DELETE FROM request_meta_key;
+
+-- 1000 flags named flag-0 .. flag-999.
+WITH RECURSIVE seq(n) AS (SELECT 0 UNION ALL SELECT n + 1 FROM seq WHERE n < 999)
+INSERT INTO feature_flags (name, key) SELECT 'Flag ' || n, 'flag-' || n FROM seq;
+
+INSERT INTO feature_flag_default_state (feature_flag_id, enabled)
+SELECT id, (id % 2 = 0) FROM feature_flags;
+
+-- Every third flag is targeted by a rule, in the shapes the suite sends.
+INSERT INTO feature_flag_rules (feature_flag_id, rule)
+SELECT id, CASE (id / 3) % 3
+  WHEN 0 THEN '{"country":["US","DE"]}'
+  WHEN 1 THEN '{"plan":"pro","beta":true}'
+  ELSE '{"platform":["ios"],"locale":"en-US"}'
+END
+FROM feature_flags WHERE id % 3 = 0;
+
+-- Prerequisite chains of length 10: flag-n requires flag-(n-1) unless n is a
+-- multiple of 10.
+INSERT INTO feature_flag_prerequisites (flag_id, prerequisite_id)
+SELECT f.id, p.id FROM feature_flags f JOIN feature_flags p ON p.id = f.id - 1
+WHERE (f.id - 1) % 10 != 0;
+
+-- Context keys that the load suite sends, as if previously observed.
+INSERT INTO request_meta_key (key_name) VALUES
+  ('userId'), ('country'), ('plan'), ('platform'), ('appVersion'),
+  ('beta'), ('orgId'), ('locale'), ('sessionAge'), ('carMake');
+
+COMMIT;
@@ -0,0 +1,272 @@
+// Load suite covering evaluation, flag writes and mixed traffic. Meant to be
+// started through load/run.sh, which brings up a seeded server.
+//
+// Every scenario uses an arrival-rate executor (open model), so a slow server
+// does not slow down the request schedule. Latency is measured both as k6 sees
+// it (http_req_duration) and from the executor's schedule slot for each
+// iteration, which corrects for coordinated omission: time spent waiting
+// behind a stalled request is counted against the server rather than silently
+// skipped. When no VU is free for a slot, k6 drops the iteration instead of
+// running it late, so dropped iterations are reported next to the percentiles
+// of each scenario; they are requests the percentiles don't cover.
+
+import http from 'k6/http';
+import exec from 'k6/execution';
+import { check } from 'k6';
+import { Counter, Trend } from 'k6/metrics';
+
+const BASE = __ENV.BASE_URL || 'http://localhost:7890';
+const RATE = parseInt(__ENV.RATE || '500', 10);
+const DURATION = __ENV.DURATION || '30s';
+const READ_RATIO = parseFloat(__ENV.READ_RATIO || '0.95');
+const N_FLAGS = 1000;
+
+const BASELINE = __ENV.BASELINE ? JSON.parse(open(__ENV.BASELINE)) : null;
+
+// Request rate of each scenario, per second. Burst scenarios are short and
+// staggered so that they overlap with steady evaluation traffic.
+const RATES = {
+  evaluate: RATE,
+  flag_burst: Math.max(1, Math.floor(RATE / 5)),
+  mixed: Math.max(1, Math.floor(RATE / 2)),
+};
+const BURST_DURATION = '3s';
+
+// k6 scenarios reported under each corrected trend.
+const SCENARIOS = {
+  evaluate: ['evaluate'],
+  flag_write: ['flag_burst_1', 'flag_burst_2'],
+  mixed: ['mixed'],
+};
+
+// Seconds in a k6 duration such as "30s", "2m" or "1m30s".
+function seconds(duration) {
+  const units = { ms: 0.001, s: 1, m: 60, h: 3600 };
+  let total = 0;
+  for (const [, n, unit] of duration.matchAll(/(\d+(?:\.\d+)?)(ms|s|m|h)/g)) total += parseFloat(n) * units[unit];
+  return total;
+}
+
+export const options = {
+  discardResponseBodies: true,
+  summaryTrendStats: ['avg', 'p(50)', 'p(99)', 'p(99.9)', 'max', 'count'],
+  scenarios: {
+    evaluate: {
+      executor: 'constant-arrival-rate',
+      exec: 'evaluate',
+      rate: RATES.evaluate,
+      timeUnit: '1s',
+      duration: DURATION,
+      preAllocatedVUs: 50,
+      maxVUs: 500,
+    },
+    flag_burst_1: {
+      executor: 'constant-arrival-rate',
+      exec: 'flagWrite',
+      rate: RATES.flag_burst,
+      timeUnit: '1s',
+      startTime: '5s',
+      duration: BURST_DURATION,
+      preAllocatedVUs: 10,
+      maxVUs: 100,
+    },
+    flag_burst_2: {
+      executor: 'constant-arrival-rate',
+      exec: 'flagWrite',
+      rate: RATES.flag_burst,
+      timeUnit: '1s',
+      startTime: '15s',
+      duration: BURST_DURATION,
+      preAllocatedVUs: 10,
+      maxVUs: 100,
+    },
+    mixed: {
+      executor: 'constant-arrival-rate',
+      exec: 'mixed',
+      rate: RATES.mixed,
+      timeUnit: '1s',
+      duration: DURATION,
+      preAllocatedVUs: 25,
+      maxVUs: 250,
+    },
+  },
+  // Always-passing thresholds, only there so the summary has dropped
+  // iterations per scenario.
+  thresholds: Object.fromEntries(
+    Object.values(SCENARIOS)
+      .flat()
+      .map((name) => [`dropped_iterations{scenario:${name}}`, ['count>=0']]),
+  ),
+};
+
+const SCENARIO_SECONDS = {
+  evaluate: seconds(DURATION),
+  flag_write: 2 * seconds(BURST_DURATION),
+  mixed: seconds(DURATION),
+};
+
+const corrected = {
+  evaluate: new Trend('corrected_evaluate', true),
+  flag_write: new Trend('corrected_flag_write', true),
+  mixed: new Trend('corrected_mixed', true),
+};
+const failures = new Counter('failed_requests');
+
+// Context shapes sent to /evaluate: a single key, a typical client payload and
+// a wide one, with a mix of strings, numbers and booleans.
+const COUNTRIES = ['US', 'DE', 'JP', 'BR', 'IN'];
+const PLANS = ['free', 'pro', 'enterprise'];
+
+function context(i) {
+  switch (i % 3) {
+    case 0:
+      return { userId: i };
+    case 1:
+      return {
+        userId: i,
+        country: COUNTRIES[i % COUNTRIES.length],
+        plan: PLANS[i % PLANS.length],
+        beta: i % 7 === 0,
+      };
+    default: {
+      const ctx = {
+        userId: i,
+        country: COUNTRIES[i % COUNTRIES.length],
+        plan: PLANS[i % PLANS.length],
+        platform: i % 2 ? 'ios' : 'android',
+        appVersion: `4.${i % 20}.0`,
+        beta: i % 7 === 0,
+        orgId: i % 311,
+        locale: 'en-US',
+        sessionAge: i % 3600,
+        carMake: 'Honda',
+      };
+      for (let k = 0; k < 10; k++) ctx[`attr${k}`] = (i * 31 + k) % 97;
+      return ctx;
+    }
+  }
+}
+
+// Milliseconds between the executor's schedule slot for an iteration that
+// began at `began` and now. Slots are every 1000 / rate ms from the scenario's
+// start; k6 starts an iteration on its slot or drops it, so the nearest slot
+// is the intended start. Iteration numbers can't be used for this, dropped
+// iterations don't get one.
+function sinceIntended(rate, began) {
+  const interval = 1000 / rate;
+  const slot = Math.round((began - exec.scenario.startTime) / interval);
+  return Date.now() - (exec.scenario.startTime + slot * interval);
+}
+
+function doEvaluate(i) {
+  const res = http.post(`${BASE}/evaluate/flag-${i % N_FLAGS}`, JSON.stringify(context(i)), {
+    headers: { 'Content-Type': 'application/json' },
+    tags: { op: 'evaluate' },
+  });
+  if (!check(res, { 'evaluate 200': (r) => r.status === 200 })) failures.add(1);
+}
+
+function doFlagWrite(i) {
+  // Alternate between creating fresh flags and updating seeded ones.
+  const key = i % 2 ? `load-${__VU}-${i}` : `flag-${i % N_FLAGS}`;
+  const body = JSON.stringify({ name: key, key: key, enabled: i % 3 === 0 });
+  const res =
+    i % 2
+      ? http.post(`${BASE}/flag/`, body, { headers: { 'Content-Type': 'application/json' }, tags: { op: 'create' } })
+      : http.put(`${BASE}/flag/`, body, { headers: { 'Content-Type': 'application/json' }, tags: { op: 'update' } });
+  if (!check(res, { 'write 2xx': (r) => r.status >= 200 && r.status < 300 })) failures.add(1);
+}
+
+export function evaluate() {
+  const began = Date.now();
+  doEvaluate(exec.scenario.iterationInTest);
+  corrected.evaluate.add(sinceIntended(RATES.evaluate, began));
+}
+
+export function flagWrite() {
+  const began = Date.now();
+  doFlagWrite(exec.scenario.iterationInTest);
+  corrected.flag_write.add(sinceIntended(RATES.flag_burst, began));
+}
+
+export function mixed() {
+  const began = Date.now();
+  const i = exec.scenario.iterationInTest;
+  if (Math.random() < READ_RATIO) doEvaluate(i);
+  else doFlagWrite(i);
+  corrected.mixed.add(sinceIntended(RATES.mixed, began));
+}
+
+// Builds the comparable report: one entry per scenario with throughput and
+// coordinated-omission-corrected percentiles. Keys are stable so that reports
+// from different builds can be diffed directly.
+function report(data) {
+  const m = data.metrics;
+  const testSeconds = data.state.testRunDurationMs / 1000;
+  const out = {
+    label: __ENV.LABEL || 'local',
+    cpus: __ENV.CPUS || '',
+    rate: RATE,
+    read_ratio: READ_RATIO,
+    duration_s: testSeconds,
+    throughput_rps: m.http_reqs ? m.http_reqs.values.count / testSeconds : 0,
+    failed_requests: m.failed_requests ? m.failed_requests.values.count : 0,
+    dropped_iterations: m.dropped_iterations ? m.dropped_iterations.values.count : 0,
+    scenarios: {},
+  };
+  for (const name of Object.keys(corrected)) {
+    const t = m[`corrected_${name}`];
+    if (!t) continue;
+    const dropped = SCENARIOS[name].reduce((n, scenario) => {
+      const d = m[`dropped_iterations{scenario:${scenario}}`];
+      return n + (d ? d.values.count : 0);
+    }, 0);
+    out.scenarios[name] = {
+      // Over the scenario's own run, not the whole test.
+      throughput_rps: t.values.count / SCENARIO_SECONDS[name],
+      dropped_iterations: dropped,
+      p50_ms: t.values['p(50)'],
+      p99_ms: t.values['p(99)'],
+      p999_ms: t.values['p(99.9)'],
+      max_ms: t.values.max,
+    };
+  }
+  return out;
+}
+
+function pct(now, then) {
+  if (!then) return '';
+  const d = ((now - then) / then) * 100;
+  return ` (${d >= 0 ? '+' : ''}${d.toFixed(1)}%)`;
+}
+
+function text(r, base) {
+  const b = base || { scenarios: {} };
+  const lines = [
+    `fastforward load report: ${r.label}${base ? ` vs ${base.label}` : ''}`,
+    `  cpus=${r.cpus} rate=${r.rate}/s read_ratio=${r.read_ratio} duration=${r.duration_s.toFixed(1)}s`,
+    `  throughput ${r.throughput_rps.toFixed(1)} req/s${pct(r.throughput_rps, b.throughput_rps)}`,
+    `  failed ${r.failed_requests}, dropped iterations ${r.dropped_iterations}`,
+    '',
+    '  scenario      req/s        p50 ms       p99 ms     p99.9 ms  dropped',
+  ];
+  for (const [name, s] of Object.entries(r.scenarios)) {
+    const o = b.scenarios[name] || {};
+    lines.push(
+      `  ${name.padEnd(12)}${s.throughput_rps.toFixed(1).padStart(7)}` +
+        `${s.p50_ms.toFixed(2).padStart(13)}${s.p99_ms.toFixed(2).padStart(13)}${s.p999_ms.toFixed(2).padStart(13)}` +
+        `${String(s.dropped_iterations).padStart(9)}`,
+    );
+    if (base && o.p50_ms !== undefined)
+      lines.push(`  ${''.padEnd(19)}${pct(s.p50_ms, o.p50_ms).padStart(13)}${pct(s.p99_ms, o.p99_ms).padStart(13)}${pct(s.p999_ms, o.p999_ms).padStart(13)}`);
+  }
+  return lines.join('\n') + '\n';
+}
+
+export function handleSummary(data) {
+  const r = report(data);
+  return {
+    stdout: text(r, BASELINE),
+    [`load/results/${r.label}.json`]: JSON.stringify(r, null, 2) + '\n',
+  };
+}
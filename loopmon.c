@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "loopmon.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "json-c/json.h"
+
+struct histogram
+{
+  uint64_t count;
+  uint64_t max_ns;
+  uint64_t total_ns;
+  uint64_t buckets[LOOPMON_N_BUCKETS];
+};
+
+struct handler_stats
+{
+  const char *name;
+  uint64_t over_budget;
+  struct histogram durations;
+};
+
+// What the event loop is working on, shared with the watchdog. Written as a
+// seqlock: `sequence` is odd while the loop is updating it.
+static struct
+{
+  uint64_t sequence;
+  // Bumped for every piece of work, so each stall is reported once.
+  uint64_t id;
+  const char *name;
+  uint64_t started_ns;
+  char statement[LOOPMON_SQL_LEN];
+} activity;
+
+static int depth = 0;
+static uint64_t budget_ns = 0;
+
+static struct histogram lag;
+static struct handler_stats handlers[LOOPMON_MAX_HANDLERS];
+static int n_handlers = 0;
+static struct loopmon_slow slow[LOOPMON_SLOW_RING_SIZE];
+static uint64_t n_slow = 0;
+
+static h2o_loop_t *probe_loop = NULL;
+static h2o_timerwheel_t *probe_timers = NULL;
+static h2o_timerwheel_entry_t probe_timer;
+static uint64_t probe_due_ns = 0;
+
+static uint64_t stall_ns = 0;
+static uint64_t stalls = 0;
+static bool watching = false;
+static pthread_t watchdog;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t wall_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void record(struct histogram *histogram, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  histogram->buckets[bucket < LOOPMON_N_BUCKETS ? bucket : LOOPMON_N_BUCKETS - 1]++;
+  histogram->count++;
+  histogram->total_ns += ns;
+  if (ns > histogram->max_ns)
+    histogram->max_ns = ns;
+}
+
+// The statement is copied a byte at a time with atomics so the watchdog can
+// read it while it changes; the sequence tells it whether it got a torn copy.
+static void store_statement(const char *sql)
+{
+  size_t k = 0;
+  for (; sql != NULL && sql[k] != '\0' && k < LOOPMON_SQL_LEN - 1; k++)
+    __atomic_store_n(&activity.statement[k], sql[k], __ATOMIC_RELAXED);
+  __atomic_store_n(&activity.statement[k], '\0', __ATOMIC_RELAXED);
+}
+
+static void load_statement(char *dst)
+{
+  for (size_t k = 0; k < LOOPMON_SQL_LEN; k++)
+    dst[k] = __atomic_load_n(&activity.statement[k], __ATOMIC_RELAXED);
+  dst[LOOPMON_SQL_LEN - 1] = '\0';
+}
+
+static void begin_update(void)
+{
+  __atomic_store_n(&activity.sequence, activity.sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_update(void)
+{
+  __atomic_store_n(&activity.sequence, activity.sequence + 1, __ATOMIC_RELEASE);
+}
+
+static struct handler_stats *handler_stats(const char *name)
+{
+  for (int k = 0; k < n_handlers; k++)
+    if (handlers[k].name == name)
+      return &handlers[k];
+  if (n_handlers == LOOPMON_MAX_HANDLERS)
+    return NULL;
+  handlers[n_handlers].name = name;
+  return &handlers[n_handlers++];
+}
+
+void loopmon_enter(const char *name)
+{
+  if (depth++ > 0)
+    return;
+  begin_update();
+  __atomic_store_n(&activity.id, activity.id + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&activity.name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&activity.started_ns, now_ns(), __ATOMIC_RELAXED);
+  store_statement(NULL);
+  end_update();
+}
+
+void loopmon_exit(void)
+{
+  if (--depth > 0)
+    return;
+  uint64_t duration = now_ns() - activity.started_ns;
+  const char *name = activity.name;
+
+  begin_update();
+  __atomic_store_n(&activity.name, NULL, __ATOMIC_RELAXED);
+  end_update();
+
+  struct handler_stats *stats = handler_stats(name);
+  if (stats != NULL)
+    record(&stats->durations, duration);
+  if (duration <= budget_ns)
+    return;
+
+  if (stats != NULL)
+    stats->over_budget++;
+  struct loopmon_slow *entry = &slow[n_slow++ % LOOPMON_SLOW_RING_SIZE];
+  entry->at_ms = wall_ms();
+  entry->duration_ns = duration;
+  entry->handler = name;
+  load_statement(entry->statement);
+}
+
+void loopmon_statement(const char *sql)
+{
+  if (depth == 0)
+    return;
+  begin_update();
+  store_statement(sql);
+  end_update();
+}
+
+static void probe_lag(h2o_timerwheel_entry_t *entry)
+{
+  uint64_t now = now_ns();
+  record(&lag, now > probe_due_ns ? now - probe_due_ns : 0);
+
+  probe_due_ns = now + LOOPMON_PROBE_INTERVAL_MS * 1000000ULL;
+  h2o_timerwheel_link_abs(probe_timers, entry, h2o_now(probe_loop) + LOOPMON_PROBE_INTERVAL_MS);
+}
+
+void loopmon_probe(h2o_loop_t *loop, h2o_timerwheel_t *timers)
+{
+  probe_loop = loop;
+  probe_timers = timers;
+  h2o_timerwheel_init_entry(&probe_timer, probe_lag);
+  probe_due_ns = now_ns() + LOOPMON_PROBE_INTERVAL_MS * 1000000ULL;
+  h2o_timerwheel_link_abs(timers, &probe_timer, h2o_now(loop) + LOOPMON_PROBE_INTERVAL_MS);
+}
+
+static void *watch(void *_unused)
+{
+  uint64_t reported = 0;
+  uint64_t interval_ns = stall_ns / 4 > 1000000 ? stall_ns / 4 : 1000000;
+  struct timespec interval = {.tv_sec = interval_ns / 1000000000ULL, .tv_nsec = interval_ns % 1000000000ULL};
+  char statement[LOOPMON_SQL_LEN];
+
+  while (__atomic_load_n(&watching, __ATOMIC_ACQUIRE))
+  {
+    nanosleep(&interval, NULL);
+
+    uint64_t sequence = __atomic_load_n(&activity.sequence, __ATOMIC_ACQUIRE);
+    if (sequence % 2 != 0)
+      continue;
+    uint64_t id = __atomic_load_n(&activity.id, __ATOMIC_RELAXED);
+    const char *name = __atomic_load_n(&activity.name, __ATOMIC_RELAXED);
+    uint64_t started = __atomic_load_n(&activity.started_ns, __ATOMIC_RELAXED);
+    load_statement(statement);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&activity.sequence, __ATOMIC_RELAXED) != sequence)
+      continue;
+
+    uint64_t running = now_ns() - started;
+    if (name == NULL || id == reported || running < stall_ns)
+      continue;
+    reported = id;
+    __atomic_fetch_add(&stalls, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "event loop stalled: %s has been running for %llu ms%s%s\n",
+            name, (unsigned long long)(running / 1000000),
+            statement[0] != '\0' ? ", last statement: " : "", statement);
+  }
+  return NULL;
+}
+
+int loopmon_start(uint64_t budget_ms, uint64_t stall_ms)
+{
+  budget_ns = budget_ms * 1000000ULL;
+  stall_ns = stall_ms * 1000000ULL;
+  if (stall_ms == 0)
+    return 0;
+
+  __atomic_store_n(&watching, true, __ATOMIC_RELEASE);
+  if (pthread_create(&watchdog, NULL, watch, NULL) != 0)
+  {
+    watching = false;
+    return -1;
+  }
+  return 0;
+}
+
+void loopmon_stop(void)
+{
+  if (probe_timers != NULL && h2o_timerwheel_is_linked(&probe_timer))
+    h2o_timerwheel_unlink(&probe_timer);
+  if (!watching)
+    return;
+  __atomic_store_n(&watching, false, __ATOMIC_RELEASE);
+  pthread_join(watchdog, NULL);
+}
+
+uint64_t loopmon_stalls(void)
+{
+  return __atomic_load_n(&stalls, __ATOMIC_RELAXED);
+}
+
+static struct json_object *histogram_json(const struct histogram *histogram)
+{
+  struct json_object *result = json_object_new_object();
+  json_object_object_add(result, "count", json_object_new_int64(histogram->count));
+  json_object_object_add(result, "max_us", json_object_new_int64(histogram->max_ns / 1000));
+  json_object_object_add(result, "mean_us", json_object_new_int64(histogram->count == 0 ? 0 : histogram->total_ns / histogram->count / 1000));
+
+  // Only buckets with anything in them; `lt_us` is absent on the last one.
+  struct json_object *buckets = json_object_new_array();
+  for (int k = 0; k < LOOPMON_N_BUCKETS; k++)
+  {
+    if (histogram->buckets[k] == 0)
+      continue;
+    struct json_object *bucket = json_object_new_object();
+    if (k < LOOPMON_N_BUCKETS - 1)
+      json_object_object_add(bucket, "lt_us", json_object_new_int64(1LL << k));
+    json_object_object_add(bucket, "count", json_object_new_int64(histogram->buckets[k]));
+    json_object_array_add(buckets, bucket);
+  }
+  json_object_object_add(result, "buckets", buckets);
+  return result;
+}
+
+struct json_object *loopmon_dump(void)
+{
+  struct json_object *result = json_object_new_object();
+  json_object_object_add(result, "lag", histogram_json(&lag));
+  json_object_object_add(result, "budget_us", json_object_new_int64(budget_ns / 1000));
+  json_object_object_add(result, "stalls", json_object_new_int64(loopmon_stalls()));
+
+  struct json_object *by_handler = json_object_new_object();
+  for (int k = 0; k < n_handlers; k++)
+  {
+    struct json_object *stats = histogram_json(&handlers[k].durations);
+    json_object_object_add(stats, "over_budget", json_object_new_int64(handlers[k].over_budget));
+    json_object_object_add(by_handler, handlers[k].name, stats);
+  }
+  json_object_object_add(result, "handlers", by_handler);
+
+  // Most recent first.
+  struct json_object *recent = json_object_new_array();
+  uint64_t n_kept = n_slow < LOOPMON_SLOW_RING_SIZE ? n_slow : LOOPMON_SLOW_RING_SIZE;
+  for (uint64_t k = 0; k < n_kept; k++)
+  {
+    const struct loopmon_slow *entry = &slow[(n_slow - 1 - k) % LOOPMON_SLOW_RING_SIZE];
+    struct json_object *item = json_object_new_object();
+    json_object_object_add(item, "at", json_object_new_int64(entry->at_ms));
+    json_object_object_add(item, "handler", json_object_new_string(entry->handler));
+    json_object_object_add(item, "us", json_object_new_int64(entry->duration_ns / 1000));
+    if (entry->statement[0] != '\0')
+      json_object_object_add(item, "statement", json_object_new_string(entry->statement));
+    json_object_array_add(recent, item);
+  }
+  json_object_object_add(result, "slow", recent);
+  return result;
+}
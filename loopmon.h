@@ -0,0 +1,53 @@
+#ifndef LOOPMON_H_
+#define LOOPMON_H_
+
+#include <stdint.h>
+
+#include "h2o.h"
+
+struct json_object;
+
+// Histograms have log2 buckets of microseconds: bucket k counts durations
+// below 2^k us, the last one everything longer.
+#define LOOPMON_N_BUCKETS 24
+#define LOOPMON_PROBE_INTERVAL_MS 10
+#define LOOPMON_MAX_HANDLERS 16
+#define LOOPMON_SLOW_RING_SIZE 64
+#define LOOPMON_SQL_LEN 128
+
+// Work on the event loop that ran over budget.
+struct loopmon_slow
+{
+  uint64_t at_ms;
+  uint64_t duration_ns;
+  const char *handler;
+  // Last statement the work ran, if any.
+  char statement[LOOPMON_SQL_LEN];
+};
+
+// Work on the event loop longer than `budget_ms` is recorded as slow. With
+// `stall_ms` set, a watchdog thread reports work still running after that
+// long to stderr, along with the statement it is on, while it is stuck.
+int loopmon_start(uint64_t budget_ms, uint64_t stall_ms);
+void loopmon_stop(void);
+
+// Measure how late `loop` gets around to timers on `timers`, every
+// LOOPMON_PROBE_INTERVAL_MS. Lag under a millisecond is timerwheel
+// granularity.
+void loopmon_probe(h2o_loop_t *loop, h2o_timerwheel_t *timers);
+
+// Brackets work on the event loop, attributed to `name`, which has to live
+// forever. Nested calls count towards the outermost one.
+void loopmon_enter(const char *name);
+void loopmon_exit(void);
+
+// Note the statement the current work is running. For `db_observe_statements`.
+void loopmon_statement(const char *sql);
+
+// Stalls the watchdog has reported.
+uint64_t loopmon_stalls(void);
+
+// Lag histogram, per-handler histograms and the most recent slow work.
+struct json_object *loopmon_dump(void);
+
+#endif // LOOPMON_H_
@@ -2,6 +2,9 @@
 #include <string.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "sqlite3.h"
 
@@ -13,18 +16,58 @@
 #include "json-c/json.h"
 #include "json-c/json_object.h"
 
+#include "accesslog.h"
+#include "batch.h"
 #include "db.h"
+#include "loopmon.h"
+#include "evaluation.h"
+#include "msgpack.h"
+#include "replica.h"
+#include "trace.h"
 #include "common.h"
 
 static sqlite3 *global_db = NULL;
 
+// Compiled from the flags in `global_db`; see `refresh_plan`.
+static struct evaluation_plan *plan = NULL;
+
 static h2o_timerwheel_t *timers = NULL;
 
+// Port to listen on, from FF_PORT.
+static uint16_t port = 7890;
+
+// Set from FF_REPLICA_OF. Replicas keep their flags in memory, follow the
+// primary's change log and reject writes.
+static const char *primary = NULL;
+
+// Number of changes served per `/changes` response.
+#define CHANGES_BATCH_SIZE 1000
+#define REPLICA_POLL_INTERVAL_MS 1000
+
+// Retention of observed context keys and values, in seconds, from
+// FF_CONTEXT_KEY_TTL and FF_CONTEXT_VALUE_TTL. 0 keeps them forever.
+static int64_t context_key_ttl = 30 * 24 * 3600;
+static int64_t context_value_ttl = 7 * 24 * 3600;
+
+// Expired context rows are purged a small batch per tick so a tick never
+// holds up the event loop for long. Ticks come quicker while a backlog lasts.
+#define CONTEXT_PURGE_INTERVAL_MS 1000
+#define CONTEXT_PURGE_BACKLOG_INTERVAL_MS 50
+#define CONTEXT_PURGE_BATCH_SIZE 256
+#define CONTEXT_VACUUM_PAGES 64
+static h2o_timerwheel_entry_t purge_timer;
+
+// Work on the event loop longer than FF_HANDLER_BUDGET_MS is recorded in
+// `/metrics/loop`. Work still running after FF_STALL_MS is reported to stderr
+// by a watchdog thread; 0 turns it off.
+static uint64_t handler_budget_ms = 10;
+static uint64_t stall_ms = 1000;
+
 static h2o_globalconf_t config;
 static h2o_context_t ctx;
 static h2o_accept_ctx_t accept_ctx;
 
-static h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *));
+static h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *), const char *name);
 
 bool record_context(json_object *context);
 
@@ -32,30 +75,65 @@ bool record_context(json_object *context);
 static int ping(h2o_handler_t *, h2o_req_t *);
 static int handle_flag(h2o_handler_t *, h2o_req_t *);
 static int evaluate_flag(h2o_handler_t *, h2o_req_t *);
+static int list_changes(h2o_handler_t *, h2o_req_t *);
+static int list_traces(h2o_handler_t *, h2o_req_t *);
+static int evaluate_batch(h2o_handler_t *, h2o_req_t *);
+static int loop_metrics(h2o_handler_t *, h2o_req_t *);
+
+static int64_t apply_changes(json_object *changes, int64_t version);
+static int32_t time_until_next_timer(void);
+static bool open_access_log(void);
+static void purge_context_metrics(h2o_timerwheel_entry_t *entry);
 
 static void on_accept(h2o_socket_t *, const char *);
 static int create_listener(void);
-
-#define PATH(path, handler, enable_timing)                \
-  {                                                       \
-    pathconf = register_handler(hostconf, path, handler); \
-    if (logfh != NULL)                                    \
-      h2o_access_log_register(pathconf, logfh);           \
-    if (enable_timing)                                    \
-      h2o_server_timing_register(pathconf, 1);            \
+static bool refresh_plan(void);
+
+#define PATH(path, handler, enable_timing)                          \
+  {                                                                 \
+    pathconf = register_handler(hostconf, path, handler, #handler); \
+    if (access_logging)                                             \
+      access_log_register(pathconf);                                \
+    if (enable_timing)                                              \
+      h2o_server_timing_register(pathconf, 1);                      \
   }
 
 int main(int argc, char **argv)
 {
   signal(SIGPIPE, SIG_IGN);
 
-  if (initialize_db(&global_db) != 0)
+  if (getenv("FF_PORT") != NULL)
+    port = (uint16_t)atoi(getenv("FF_PORT"));
+  primary = getenv("FF_REPLICA_OF");
+  if (getenv("FF_TRACE_SAMPLE") != NULL)
+    trace_set_sampling(strtoull(getenv("FF_TRACE_SAMPLE"), NULL, 10));
+  if (getenv("FF_CONTEXT_KEY_TTL") != NULL)
+    context_key_ttl = strtoll(getenv("FF_CONTEXT_KEY_TTL"), NULL, 10);
+  if (getenv("FF_CONTEXT_VALUE_TTL") != NULL)
+    context_value_ttl = strtoll(getenv("FF_CONTEXT_VALUE_TTL"), NULL, 10);
+  if (getenv("FF_HANDLER_BUDGET_MS") != NULL)
+    handler_budget_ms = strtoull(getenv("FF_HANDLER_BUDGET_MS"), NULL, 10);
+  if (getenv("FF_STALL_MS") != NULL)
+    stall_ms = strtoull(getenv("FF_STALL_MS"), NULL, 10);
+
+  if ((primary == NULL ? initialize_db(&global_db) : initialize_db_mem(&global_db)) != 0)
   {
     fprintf(stderr, "failed to initialize db\n");
     return 1;
   }
+  if (!refresh_plan())
+  {
+    fprintf(stderr, "failed to load flags\n");
+    return 1;
+  }
+  db_observe_statements(loopmon_statement);
+  if (loopmon_start(handler_budget_ms, stall_ms) != 0)
+  {
+    fprintf(stderr, "failed to start event loop watchdog\n");
+    return 1;
+  }
 
-  h2o_access_log_filehandle_t *logfh = h2o_access_log_open_handle("/dev/stdout", NULL, H2O_LOGCONF_ESCAPE_APACHE);
+  bool access_logging = open_access_log();
   h2o_config_init(&config);
 
   h2o_hostconf_t *hostconf = h2o_config_register_host(&config, h2o_iovec_init(H2O_STRLIT("default")), 65535);
@@ -64,17 +142,23 @@ int main(int argc, char **argv)
   PATH("/ping", ping, true);
   PATH("/flag", handle_flag, true);
   PATH("/evaluate", evaluate_flag, true);
+  PATH("/changes", list_changes, false);
+  PATH("/traces", list_traces, false);
+  PATH("/batch", evaluate_batch, false);
+  pathconf->handlers.entries[0]->supports_request_streaming = 1;
+  PATH("/metrics/loop", loop_metrics, false);
 
   pathconf = h2o_config_register_path(hostconf, "/", 0);
   h2o_file_register(pathconf, "./ui", NULL, NULL, 0);
-  if (logfh != NULL)
+  if (access_logging)
   {
-    h2o_access_log_register(pathconf, logfh);
+    access_log_register(pathconf);
   }
 
   // Initialize timerwheel and context.
   h2o_context_init(&ctx, h2o_evloop_create(), &config);
   timers = h2o_timerwheel_create(5, h2o_now(ctx.loop));
+  loopmon_probe(ctx.loop, timers);
 
   accept_ctx.ctx = &ctx;
   accept_ctx.hosts = config.hosts;
@@ -84,38 +168,182 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  fprintf(stderr, "starting to listen on port 7890\n");
-  while (h2o_evloop_run(ctx.loop, INT32_MAX) == 0)
-    ;
+  if (primary != NULL && replica_start(ctx.loop, timers, primary, REPLICA_POLL_INTERVAL_MS, apply_changes) != 0)
+  {
+    fprintf(stderr, "invalid FF_REPLICA_OF, expected ipv4:port\n");
+    return 1;
+  }
+
+  h2o_timerwheel_init_entry(&purge_timer, purge_context_metrics);
+  if (context_key_ttl > 0 || context_value_ttl > 0)
+    h2o_timerwheel_link_abs(timers, &purge_timer, h2o_now(ctx.loop) + CONTEXT_PURGE_INTERVAL_MS);
+
+  fprintf(stderr, "starting to listen on port %u%s\n", port, primary != NULL ? " as a replica" : "");
+  while (h2o_evloop_run(ctx.loop, time_until_next_timer()) == 0)
+    h2o_timerwheel_run(timers, h2o_now(ctx.loop));
 
   fprintf(stderr, "shutting down\n");
+  loopmon_stop();
   h2o_timerwheel_destroy(timers);
+  free_evaluation_plan(plan);
+  if (access_logging)
+  {
+    access_log_stop();
+    fprintf(stderr, "access log dropped %llu lines\n", (unsigned long long)access_log_dropped());
+  }
   if (close_db(&global_db) != 0)
     fprintf(stderr, "encountered error while closing db, but we're terminating so nbd\n");
   return 0;
 }
 
-static h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *))
+// Access log destination from FF_ACCESS_LOG, stdout by default, "off" to
+// disable. FF_ACCESS_LOG_SAMPLE logs 1 in N requests.
+static bool open_access_log(void)
+{
+  const char *path = getenv("FF_ACCESS_LOG");
+  if (path != NULL && strcmp(path, "off") == 0)
+    return false;
+
+  int fd = path == NULL ? STDOUT_FILENO : open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "failed to open access log %s\n", path);
+    return false;
+  }
+  uint64_t sample_every = getenv("FF_ACCESS_LOG_SAMPLE") != NULL ? strtoull(getenv("FF_ACCESS_LOG_SAMPLE"), NULL, 10) : 1;
+  if (access_log_start(fd, ACCESS_LOG_BUFFER_SIZE, sample_every) != 0)
+  {
+    fprintf(stderr, "failed to start access log\n");
+    return false;
+  }
+  return true;
+}
+
+// How long the event loop may block before the next entry on `timers` is due.
+static int32_t time_until_next_timer(void)
+{
+  uint64_t wake_at = h2o_timerwheel_get_wake_at(timers);
+  uint64_t now = h2o_now(ctx.loop);
+  if (wake_at <= now)
+    return 0;
+  return wake_at - now > INT32_MAX ? INT32_MAX : (int32_t)(wake_at - now);
+}
+
+static void purge_context_metrics(h2o_timerwheel_entry_t *entry)
+{
+  loopmon_enter("purge_context_metrics");
+  int purged = db_purge_context_metrics(global_db, (int64_t)time(NULL), context_key_ttl, context_value_ttl, CONTEXT_PURGE_BATCH_SIZE);
+  if (purged < 0)
+    fprintf(stderr, "failed to purge context metrics: %s\n", sqlite3_errmsg(global_db));
+  else if (db_incremental_vacuum(global_db, CONTEXT_VACUUM_PAGES) != DB_OK)
+    fprintf(stderr, "failed to vacuum: %s\n", sqlite3_errmsg(global_db));
+
+  uint64_t delay = purged == CONTEXT_PURGE_BATCH_SIZE ? CONTEXT_PURGE_BACKLOG_INTERVAL_MS : CONTEXT_PURGE_INTERVAL_MS;
+  h2o_timerwheel_link_abs(timers, entry, h2o_now(ctx.loop) + delay);
+  loopmon_exit();
+}
+
+// Handlers are wrapped so the loop monitor can attribute their time.
+struct monitored_handler
+{
+  h2o_handler_t super;
+  int (*on_req)(h2o_handler_t *, h2o_req_t *);
+  const char *name;
+};
+
+static int on_monitored_req(h2o_handler_t *self, h2o_req_t *req)
+{
+  struct monitored_handler *handler = (struct monitored_handler *)self;
+  loopmon_enter(handler->name);
+  int result = handler->on_req(self, req);
+  loopmon_exit();
+  return result;
+}
+
+static h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *), const char *name)
 {
   h2o_pathconf_t *pathconf = h2o_config_register_path(hostconf, path, 0);
-  h2o_handler_t *handler = h2o_create_handler(pathconf, sizeof(*handler));
+  struct monitored_handler *handler = (struct monitored_handler *)h2o_create_handler(pathconf, sizeof(*handler));
+  handler->super.on_req = on_monitored_req;
   handler->on_req = on_req;
+  handler->name = name;
   return pathconf;
 }
 
+#define NE_UNSUPPORTED_MEDIA_TYPE 0x0001
+#define NE_DB_ERROR 0x0002
+#define NE_CONFLICT 0x0003
+#define NE_BAD_REQUEST 0x0004
+#define NE_NOT_FOUND 0x0005
+#define NE_CYCLE 0x0006
+#define NE_READ_ONLY 0x0007
+#define NE_OUT_OF_MEMORY 0x0008
+#define NE_LINE_TOO_LONG 0x0009
+
 int get_error_code_status(int error_code)
 {
-  return 415;
+  switch (error_code)
+  {
+  case NE_UNSUPPORTED_MEDIA_TYPE:
+    return 415;
+  case NE_CONFLICT:
+  case NE_CYCLE:
+    return 409;
+  case NE_BAD_REQUEST:
+    return 400;
+  case NE_NOT_FOUND:
+    return 404;
+  case NE_READ_ONLY:
+    return 403;
+  default:
+    return 500;
+  }
 }
 
 const char *get_status_reason(int status)
 {
-  return "Error";
+  switch (status)
+  {
+  case 400:
+    return "Bad Request";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 409:
+    return "Conflict";
+  case 415:
+    return "Unsupported Media Type";
+  default:
+    return "Error";
+  }
 }
 
 const char *get_error_code_message(int error_code)
 {
-  return "Generic error";
+  switch (error_code)
+  {
+  case NE_UNSUPPORTED_MEDIA_TYPE:
+    return "N0001 - unsupported media type";
+  case NE_DB_ERROR:
+    return "N0002 - failed to issue query";
+  case NE_CONFLICT:
+    return "N0003 - a flag with the provided name or key already exists";
+  case NE_BAD_REQUEST:
+    return "N0004 - malformed request body";
+  case NE_NOT_FOUND:
+    return "N0005 - no such flag";
+  case NE_CYCLE:
+    return "N0006 - prerequisites would form a cycle";
+  case NE_READ_ONLY:
+    return "N0007 - this node is a read replica";
+  case NE_OUT_OF_MEMORY:
+    return "N0008 - out of memory";
+  case NE_LINE_TOO_LONG:
+    return "N0009 - line too long";
+  default:
+    return "Generic error";
+  }
 }
 
 int respond_str(h2o_req_t *req, const char *str)
@@ -123,7 +351,7 @@ int respond_str(h2o_req_t *req, const char *str)
   static h2o_generator_t generator = {NULL, NULL};
 
   h2o_start_response(req, &generator);
-  h2o_iovec_t resp = h2o_iovec_init(STRLIT(str));
+  h2o_iovec_t resp = h2o_iovec_init(str, strlen(str));
   h2o_send(req, &resp, 1, H2O_SEND_STATE_FINAL);
   return 0;
 }
@@ -136,9 +364,19 @@ int respond_error(h2o_req_t *req, int error_code)
   return respond_str(req, message);
 }
 
-#define NE_UNSUPPORTED_MEDIA_TYPE 0x0001
-#define NE_DB_ERROR 0x0002
-#define NE_CONFLICT 0x0003
+// Serialize `body` as the response and release it.
+int respond_json(h2o_req_t *req, int status, const char *reason, json_object *body)
+{
+  size_t len = 0;
+  const char *serialized = json_object_to_json_string_length(body, JSON_C_TO_STRING_PLAIN, &len);
+
+  req->res.status = status;
+  req->res.reason = reason;
+  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("application/json"));
+  h2o_send_inline(req, serialized, len);
+  json_object_put(body);
+  return 0;
+}
 
 #define ASSERT_REQ(expr, error_code)       \
   if (!(expr))                             \
@@ -146,139 +384,400 @@ int respond_error(h2o_req_t *req, int error_code)
     return respond_error(req, error_code); \
   }
 
-// Evaluate the state of a feature flag.
-static int evaluate_flag(h2o_handler_t *self, h2o_req_t *req)
+static bool has_content_type(h2o_req_t *req, const char *type, size_t type_len)
 {
-  static h2o_generator_t generator = {NULL, NULL};
-  const char *_unused = NULL;
+  ssize_t index = h2o_find_header(&req->headers, H2O_TOKEN_CONTENT_TYPE, -1);
+  if (index == -1)
+    return false;
+  h2o_iovec_t value = req->headers.entries[index].value;
+  return value.len >= type_len && h2o_memis(value.base, type_len, type, type_len);
+}
+
+// Value of query parameter `name`, not decoded. `base` is NULL if the
+// parameter is missing; parameters without a value are empty.
+static h2o_iovec_t query_param(h2o_req_t *req, const char *name, size_t name_len)
+{
+  if (req->query_at == SIZE_MAX)
+    return h2o_iovec_init(NULL, 0);
+
+  const char *pos = req->path.base + req->query_at + 1;
+  const char *end = req->path.base + req->path.len;
+  while (pos < end)
+  {
+    const char *param_end = memchr(pos, '&', end - pos);
+    if (param_end == NULL)
+      param_end = end;
+    if ((size_t)(param_end - pos) >= name_len && memcmp(pos, name, name_len) == 0 &&
+        (pos + name_len == param_end || pos[name_len] == '='))
+    {
+      const char *value = pos + name_len == param_end ? param_end : pos + name_len + 1;
+      return h2o_strdup(&req->pool, value, param_end - value);
+    }
+    pos = param_end + 1;
+  }
+  return h2o_iovec_init(NULL, 0);
+}
 
-  ASSERT_REQ(strncmp(
-                 req->headers.entries[h2o_find_header(&req->headers, H2O_TOKEN_CONTENT_TYPE, -1)].value.base,
-                 STRLIT("application/json")) == 0,
-             NE_UNSUPPORTED_MEDIA_TYPE);
+// Parse the request body as JSON. Returns NULL if it is empty or malformed.
+static json_object *parse_entity(h2o_req_t *req)
+{
+  if (req->entity.base == NULL || req->entity.len == 0)
+    return NULL;
 
-  ASSERT_REQ(!db_begin(global_db), NE_DB_ERROR);
+  json_tokener *tokener = json_tokener_new();
+  json_object *parsed = json_tokener_parse_ex(tokener, req->entity.base, (int)req->entity.len);
+  if (json_tokener_get_error(tokener) != json_tokener_success)
+  {
+    json_object_put(parsed);
+    parsed = NULL;
+  }
+  json_tokener_free(tokener);
+  return parsed;
+}
 
-  sqlite3_stmt *statement = NULL;
-  sqlite3_prepare_v2(
-      global_db,
-      STRLIT("SELECT * FROM feature_flags WHERE name = @name OR key = @key"),
-      &statement,
-      &_unused);
+// Recompile the evaluation plan. Called at startup and after every flag write,
+// so that evaluations never touch SQLite for flag state.
+static bool refresh_plan(void)
+{
+  struct evaluation_plan *fresh = db_load_evaluation_plan(global_db);
+  if (fresh == NULL)
+    return false;
+  free_evaluation_plan(plan);
+  plan = fresh;
+  return true;
+}
 
-  int rows_found = 0;
-  for (;;)
+// Quality the Accept header `value` gives `type`, from 0 to 1000, or -1 if it
+// doesn't name it. Wildcards don't count as naming a type.
+static int accept_quality(h2o_iovec_t value, const char *type, size_t type_len)
+{
+  const char *pos = value.base, *end = value.base + value.len;
+  while (pos < end)
   {
-    int result = sqlite3_step(statement);
-    switch (result)
+    const char *range_end = memchr(pos, ',', end - pos);
+    if (range_end == NULL)
+      range_end = end;
+    while (pos < range_end && (*pos == ' ' || *pos == '\t'))
+      pos++;
+    const char *params = memchr(pos, ';', range_end - pos);
+    const char *type_end = params != NULL ? params : range_end;
+    while (type_end > pos && (type_end[-1] == ' ' || type_end[-1] == '\t'))
+      type_end--;
+    if (h2o_lcstris(pos, type_end - pos, type, type_len))
     {
-    case SQLITE_ROW:
-      rows_found++;
-      break;
-    case SQLITE_DONE:
-      sqlite3_finalize(statement);
-      break;
-    default:
-      sqlite3_finalize(statement);
-      break;
+      size_t q = params == NULL ? SIZE_MAX : h2o_strstr(params, range_end - params, H2O_STRLIT("q="));
+      if (q == SIZE_MAX)
+        return 1000;
+      // q=0.5 is 500.
+      int quality = 0, scale = 1000;
+      for (const char *digit = params + q + 2; digit < range_end && scale > 0; digit++)
+      {
+        if (*digit == '.')
+          continue;
+        if (*digit < '0' || *digit > '9')
+          break;
+        quality += (*digit - '0') * scale;
+        scale /= 10;
+      }
+      return quality < 1000 ? quality : 1000;
     }
+    pos = range_end + 1;
   }
-  ASSERT_REQ(rows_found == 0, NE_CONFLICT);
-  // req->res.reason = "Conflict";
-  // h2o_send_inline(req, STRLIT("N0001 - a flag with the provided name or key already exists"));
-  // return 0;
+  return -1;
+}
 
-  // Get parameters for evaluation and record them.
-  json_object *evaluation_parameters = json_tokener_parse(req->entity.base);
+// Callers get back what they sent, unless Accept prefers the other of JSON
+// and MessagePack. A missing Accept or a wildcard is no preference.
+static bool accepts_msgpack(h2o_req_t *req, bool msgpack_request)
+{
+  ssize_t index = h2o_find_header(&req->headers, H2O_TOKEN_ACCEPT, -1);
+  if (index == -1)
+    return msgpack_request;
+  h2o_iovec_t value = req->headers.entries[index].value;
+  int json = accept_quality(value, H2O_STRLIT("application/json"));
+  int msgpack = accept_quality(value, H2O_STRLIT(MSGPACK_CONTENT_TYPE));
+  if (json == msgpack)
+    return msgpack_request;
+  return msgpack > json;
+}
+
+// Respond with a `{ key: state }` map of the steps at `indices`, or of every
+// step if `indices` is NULL.
+static int respond_results(h2o_req_t *req, bool as_msgpack, const int *indices, int n_indices, const bool *results)
+{
+  if (!as_msgpack)
+  {
+    json_object *response = json_object_new_object();
+    for (int k = 0; k < n_indices; k++)
+    {
+      int index = indices == NULL ? k : indices[k];
+      json_object_object_add(response, plan->steps[index].key, json_object_new_boolean(results[index]));
+    }
+    return respond_json(req, 200, "OK", response);
+  }
 
-  h2o_iovec_t body = h2o_strdup(&req->pool, "true", SIZE_MAX);
+  size_t capacity = MSGPACK_MAX_HEADER;
+  for (int k = 0; k < n_indices; k++)
+    capacity += MSGPACK_MAX_HEADER + strlen(plan->steps[indices == NULL ? k : indices[k]].key) + 1;
 
+  uint8_t *start = h2o_mem_alloc_pool(&req->pool, uint8_t, capacity);
+  uint8_t *end = msgpack_write_map_header(start, n_indices);
+  for (int k = 0; k < n_indices; k++)
+  {
+    int index = indices == NULL ? k : indices[k];
+    const char *key = plan->steps[index].key;
+    end = msgpack_write_str(end, key, strlen(key));
+    end = msgpack_write_bool(end, results[index]);
+  }
+
+  static h2o_generator_t generator = {NULL, NULL};
   req->res.status = 200;
   req->res.reason = "OK";
-  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain; charset=utf-8"));
+  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT(MSGPACK_CONTENT_TYPE));
+  h2o_start_response(req, &generator);
+  h2o_iovec_t body = h2o_iovec_init(start, end - start);
+  h2o_send(req, &body, 1, H2O_SEND_STATE_FINAL);
+  return 0;
+}
+
+// Evaluate the state of a feature flag. `/evaluate/<key>` responds with the
+// flag and all of its prerequisites, `/evaluate` with every flag. Contexts may
+// be sent as JSON or MessagePack.
+static int evaluate_flag(h2o_handler_t *self, h2o_req_t *req)
+{
+  bool msgpack_request = has_content_type(req, H2O_STRLIT(MSGPACK_CONTENT_TYPE));
+  ASSERT_REQ(msgpack_request || has_content_type(req, H2O_STRLIT("application/json")), NE_UNSUPPORTED_MEDIA_TYPE);
+  ASSERT_REQ(plan != NULL, NE_DB_ERROR);
+
+  bool explain = query_param(req, H2O_STRLIT("explain")).base != NULL;
+  struct trace trace;
+  trace_begin(&trace, explain);
+
+  // Every return from here on goes through `done`, to end the trace.
+  int status = 0;
+  int target = -1;
+  const size_t prefix_len = sizeof("/evaluate/") - 1;
+  if (req->path_normalized.len > prefix_len)
+  {
+    h2o_iovec_t key = h2o_strdup(&req->pool, req->path_normalized.base + prefix_len, req->path_normalized.len - prefix_len);
+    target = find_plan_step(plan, key.base);
+    if (target < 0)
+    {
+      status = respond_error(req, NE_NOT_FOUND);
+      goto done;
+    }
+    if (trace.active)
+      strncpy(trace.record.flag_key, key.base, TRACE_KEY_LEN - 1);
+  }
+  TRACE_MARK(&trace, TRACE_LOOKUP);
+
+  json_object *context = msgpack_request
+                             ? msgpack_decode_context((const uint8_t *)req->entity.base, req->entity.len)
+                             : parse_entity(req);
+  TRACE_MARK(&trace, TRACE_PARSE);
+  if (context == NULL || !json_object_is_type(context, json_type_object) || !is_valid_context(context))
+  {
+    json_object_put(context);
+    status = respond_error(req, NE_BAD_REQUEST);
+    goto done;
+  }
+  TRACE_MARK(&trace, TRACE_VALIDATE);
+
+  bool *results = h2o_mem_alloc_pool(&req->pool, bool, plan->n_steps + 1);
+  const int *indices = NULL;
+  int n_indices = plan->n_steps;
+  json_object *steps = NULL;
+  if (target >= 0)
+  {
+    indices = plan->steps[target].closure;
+    n_indices = plan->steps[target].n_closure;
+  }
+  if (explain)
+    steps = explain_plan(plan, target, context, results);
+  else if (target < 0)
+    evaluate_plan_all(plan, context, results);
+  else
+    evaluate_plan(plan, target, context, results);
+  if (trace.active)
+    trace.record.n_evaluated = n_indices;
+  TRACE_MARK(&trace, TRACE_MATCH);
+
+  if (!record_context_metrics(global_db, context))
+    fprintf(stderr, "failed to record context metrics\n");
+  json_object_put(context);
+  TRACE_MARK(&trace, TRACE_RECORD);
+
   h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ACCESS_CONTROL_ALLOW_METHODS, NULL, H2O_STRLIT("*"));
   h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ACCESS_CONTROL_ALLOW_HEADERS, NULL, H2O_STRLIT("*"));
+  if (!explain)
+  {
+    respond_results(req, accepts_msgpack(req, msgpack_request), indices, n_indices, results);
+    TRACE_MARK(&trace, TRACE_RESPOND);
+    goto done;
+  }
 
-  // Issue request to SQLite and wait for result.
-  if (sqlite3_prepare_v2(
-          global_db,
-          // TODO: Replace with our own macro since this could change.
-          STRLIT("SELECT id, name, key FROM feature_flags"),
-          &statement,
-          &_unused) != SQLITE_OK)
-    return 1;
-
-  struct row
+  // Explained responses are always JSON, with the trace next to the results.
+  // Their respond stage only shows up in `/traces`.
+  json_object *response = json_object_new_object();
+  json_object *states = json_object_new_object();
+  for (int k = 0; k < n_indices; k++)
   {
-    int32_t id;
-    char *name;
-    char *key;
-  };
-
-  struct row *rows = NULL;
-  int n_rows = 0;
-  for (;;)
+    int index = indices == NULL ? k : indices[k];
+    json_object_object_add(states, plan->steps[index].key, json_object_new_boolean(results[index]));
+  }
+  json_object *explanation = json_object_new_object();
+  json_object_object_add(explanation, "stages_ns", trace_stages_json(&trace.record));
+  json_object_object_add(explanation, "steps", steps);
+  json_object_object_add(response, "results", states);
+  json_object_object_add(response, "explain", explanation);
+  respond_json(req, 200, "OK", response);
+  TRACE_MARK(&trace, TRACE_RESPOND);
+
+done:
+  trace_end(&trace);
+  return status;
+}
+
+// State of a `/batch` request. Input is consumed one chunk at a time, and
+// only up to BATCH_PENDING_HIGH_WATER of results at a time; the rest of a
+// chunk waits until those have been sent, and the next chunk is only asked
+// for once all of this one has. Memory use is bounded by the chunk size and
+// the high-water mark whatever the body size.
+struct batch_evaluation
+{
+  h2o_generator_t super;
+  h2o_req_t *req;
+  struct batch batch;
+
+  // Rest of the current chunk, not evaluated yet.
+  h2o_iovec_t unread;
+  bool end_stream;
+
+  // Result lines being sent; `batch.pending` collects the next ones.
+  h2o_buffer_t *sending;
+
+  bool sending_in_flight;
+  bool input_done;
+};
+
+static void dispose_batch(void *_batch)
+{
+  struct batch_evaluation *batch = _batch;
+  batch_dispose(&batch->batch);
+  h2o_buffer_dispose(&batch->sending);
+}
+
+static void evaluate_unread(struct batch_evaluation *batch)
+{
+  size_t taken = batch_evaluate_chunk(&batch->batch, plan, batch->unread.base, batch->unread.len, batch->end_stream);
+  batch->unread.base += taken;
+  batch->unread.len -= taken;
+  batch->input_done = batch->end_stream && batch->unread.len == 0;
+}
+
+// Send pending results if nothing is in flight, evaluating more of the
+// current chunk first if they have all been sent. Once the chunk is used up,
+// ask for more input.
+static void flush_batch(struct batch_evaluation *batch)
+{
+  if (batch->sending_in_flight)
+    return;
+
+  if (batch->batch.pending->size == 0 && batch->unread.len != 0)
+    evaluate_unread(batch);
+  if (batch->batch.pending->size == 0 && !batch->input_done)
   {
-    int result = sqlite3_step(statement);
-    if (result == SQLITE_BUSY)
-    {
-      continue;
-    }
-    if (result == SQLITE_DONE)
-    {
-      break;
-    }
-    if (result == SQLITE_ROW)
-    {
-      struct row row;
-      row.id = sqlite3_column_int(statement, 0);
-      const unsigned char *name = sqlite3_column_text(statement, 1);
-      const size_t name_len = strlen((const char *)name);
-      const unsigned char *key = sqlite3_column_text(statement, 2);
-      const size_t key_len = strlen((const char *)key);
-
-      row.name = malloc((name_len + 1) * sizeof(char));
-      row.key = malloc((key_len + 1) * sizeof(char));
-      strlcpy(row.name, (const char *)name, name_len + 1);
-      strlcpy(row.key, (const char *)key, key_len + 1);
-
-      if (n_rows == 0)
-      {
-        rows = calloc(1, sizeof(struct row));
-        memset(rows, 0, 1 * sizeof(struct row));
-        n_rows = 0;
-      }
-      else
-      {
-        rows = realloc(rows, (n_rows + 1) * sizeof(struct row));
-      }
-      rows[n_rows] = row;
-      n_rows++;
-      continue;
-    }
+    batch->req->proceed_req(batch->req, NULL);
+    return;
+  }
 
-    sqlite3_finalize(statement);
-    req->res.status = 500;
-    req->res.reason = "Encountered an error while querying SQLite.";
-    h2o_send(req, NULL, 0, H2O_SEND_STATE_FINAL);
-    return 0;
+  h2o_buffer_t *swap = batch->sending;
+  batch->sending = batch->batch.pending;
+  batch->batch.pending = swap;
+  h2o_buffer_consume(&batch->batch.pending, batch->batch.pending->size);
+
+  h2o_iovec_t buf = h2o_iovec_init(batch->sending->bytes, batch->sending->size);
+  batch->sending_in_flight = true;
+  h2o_send(batch->req, &buf, buf.len == 0 ? 0 : 1, batch->input_done ? H2O_SEND_STATE_FINAL : H2O_SEND_STATE_IN_PROGRESS);
+}
+
+static int on_batch_chunk(void *_batch, int is_end_stream)
+{
+  struct batch_evaluation *batch = _batch;
+  loopmon_enter("on_batch_chunk");
+  batch->unread = batch->req->entity;
+  batch->end_stream = is_end_stream;
+  evaluate_unread(batch);
+  flush_batch(batch);
+  loopmon_exit();
+  return 0;
+}
+
+static void on_batch_proceed(h2o_generator_t *generator, h2o_req_t *req)
+{
+  struct batch_evaluation *batch = (struct batch_evaluation *)generator;
+  batch->sending_in_flight = false;
+  h2o_buffer_consume(&batch->sending, batch->sending->size);
+  flush_batch(batch);
+}
+
+static void on_batch_stop(h2o_generator_t *generator, h2o_req_t *req)
+{
+  // Buffers are released with the request's pool.
+}
+
+// Evaluate newline-delimited JSON contexts in the request body, streaming one
+// line of results per context back as NDJSON. `/batch/<key>` evaluates one flag
+// and its prerequisites per context, `/batch` every flag. Lines that fail to
+// parse get an `{"error": ...}` line. Unlike `/evaluate`, contexts aren't
+// recorded, so throughput is bounded by evaluation rather than by SQLite.
+static int evaluate_batch(h2o_handler_t *self, h2o_req_t *req)
+{
+  ASSERT_REQ(has_content_type(req, H2O_STRLIT("application/x-ndjson")), NE_UNSUPPORTED_MEDIA_TYPE);
+  ASSERT_REQ(plan != NULL, NE_DB_ERROR);
+
+  const char *key = NULL;
+  const size_t prefix_len = sizeof("/batch/") - 1;
+  if (req->path_normalized.len > prefix_len)
+  {
+    key = h2o_strdup(&req->pool, req->path_normalized.base + prefix_len, req->path_normalized.len - prefix_len).base;
+    ASSERT_REQ(find_plan_step(plan, key) >= 0, NE_NOT_FOUND);
   }
 
-  h2o_start_response(req, &generator);
+  struct batch_evaluation *batch = h2o_mem_alloc_shared(&req->pool, sizeof(*batch), dispose_batch);
+  memset(batch, 0, sizeof(*batch));
+  batch->super.proceed = on_batch_proceed;
+  batch->super.stop = on_batch_stop;
+  batch->req = req;
+  batch_init(&batch->batch, key);
+  h2o_buffer_init(&batch->sending, &h2o_socket_buffer_prototype);
+
+  req->res.status = 200;
+  req->res.reason = "OK";
+  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("application/x-ndjson"));
+  h2o_start_response(req, &batch->super);
 
-  // Build response data
-  char str[4096];
-  for (int k = 0; k < n_rows; k++)
+  // Without `proceed_req` the whole body has already arrived.
+  if (req->proceed_req != NULL)
   {
-    struct row r = rows[k];
-    strlcat(str, r.name, 4096);
-    strlcat(str, "\n", 4096);
+    req->write_req.cb = on_batch_chunk;
+    req->write_req.ctx = batch;
   }
-  h2o_iovec_t resp_body = h2o_iovec_init(str, strlen(str));
-  h2o_send(req, &resp_body, 1, H2O_SEND_STATE_FINAL);
+  on_batch_chunk(batch, req->proceed_req == NULL);
   return 0;
 }
 
+// Dump the sampled and explained evaluation traces in the ring buffer.
+static int list_traces(h2o_handler_t *self, h2o_req_t *req)
+{
+  return respond_json(req, 200, "OK", trace_dump());
+}
+
+static int loop_metrics(h2o_handler_t *self, h2o_req_t *req)
+{
+  return respond_json(req, 200, "OK", loopmon_dump());
+}
+
 static int ping(h2o_handler_t *self, h2o_req_t *req)
 {
   static h2o_generator_t generator = {NULL, NULL};
@@ -293,74 +792,99 @@ int get_flag_state(h2o_handler_t *self, h2o_req_t *req)
   return 0;
 }
 
+// Create or update a flag from the JSON document in the request body. See
+// `db_put_flag` for its shape.
+static int write_flag(h2o_req_t *req, bool create)
+{
+  ASSERT_REQ(primary == NULL, NE_READ_ONLY);
+  ASSERT_REQ(has_content_type(req, H2O_STRLIT("application/json")), NE_UNSUPPORTED_MEDIA_TYPE);
+
+  json_object *flag = parse_entity(req);
+  int result = db_put_flag(global_db, flag, create);
+  json_object_put(flag);
+
+  switch (result)
+  {
+  case DB_OK:
+    break;
+  case DB_INVALID:
+    return respond_error(req, NE_BAD_REQUEST);
+  case DB_CONFLICT:
+    return respond_error(req, NE_CONFLICT);
+  case DB_NOT_FOUND:
+    return respond_error(req, NE_NOT_FOUND);
+  case DB_CYCLE:
+    return respond_error(req, NE_CYCLE);
+  default:
+    return respond_error(req, NE_DB_ERROR);
+  }
+  ASSERT_REQ(refresh_plan(), NE_DB_ERROR);
+
+  req->res.status = create ? 201 : 200;
+  req->res.reason = create ? "Created" : "OK";
+  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain; charset=utf-8"));
+  return respond_str(req, create ? "Created" : "Updated");
+}
+
 int update_flag(h2o_handler_t *self, h2o_req_t *req)
 {
-  static h2o_generator_t generator = {NULL, NULL};
-  req->res.status = 201;
-  req->res.reason = "Created";
-  h2o_start_response(req, &generator);
-  h2o_iovec_t body = h2o_strdup(&req->pool, H2O_STRLIT("Created flagname"));
-  h2o_send(req, &body, 1, H2O_SEND_STATE_FINAL);
-  return 0;
+  return write_flag(req, false);
 }
 
 int create_flag(h2o_handler_t *self, h2o_req_t *req)
 {
-  sqlite3_stmt *statement = NULL;
-  sqlite3_exec(global_db, "BEGIN", NULL, NULL, NULL);
-
-  // TODO: Parse the body into a JSON blob.
-  sqlite3_prepare_v2(
-      global_db,
-      STRLIT("INSERT INTO feature_flags (name, key) VALUES (@name, replace(@key, ' ', '-'))"),
-      &statement,
-      NULL);
-  sqlite3_bind_text(
-      statement,
-      sqlite3_bind_parameter_index(statement, "@name"),
-      req->entity.base,
-      req->entity.len,
-      NULL);
-  sqlite3_bind_text(
-      statement,
-      sqlite3_bind_parameter_index(statement, "@key"),
-      req->entity.base,
-      req->entity.len,
-      NULL);
-
-  int64_t ff_id = -1;
-  for (;;)
+  return write_flag(req, true);
+}
+
+// Serve the change log to replicas: `/changes?since=<version>` responds with
+// the changes after `version`, oldest first, and whether more are waiting.
+static int list_changes(h2o_handler_t *self, h2o_req_t *req)
+{
+  h2o_iovec_t since_param = query_param(req, H2O_STRLIT("since"));
+  int64_t since = since_param.base == NULL ? 0 : strtoll(since_param.base, NULL, 10);
+
+  json_object *changes = NULL;
+  ASSERT_REQ(db_changes_since(global_db, since, CHANGES_BATCH_SIZE, &changes) == DB_OK, NE_DB_ERROR);
+
+  size_t n_changes = json_object_array_length(changes);
+  int64_t version = since;
+  if (n_changes > 0)
+    version = json_object_get_int64(json_object_object_get(json_object_array_get_idx(changes, n_changes - 1), "version"));
+
+  json_object *response = json_object_new_object();
+  json_object_object_add(response, "version", json_object_new_int64(version));
+  json_object_object_add(response, "more", json_object_new_boolean(n_changes == CHANGES_BATCH_SIZE));
+  json_object_object_add(response, "changes", changes);
+  return respond_json(req, 200, "OK", response);
+}
+
+// Apply changes from the primary's log to our in-memory flags. Flags are
+// upserted, and the plan is recompiled once per batch.
+static int64_t apply_changes(json_object *changes, int64_t version)
+{
+  size_t n_applied = 0;
+  loopmon_enter("apply_changes");
+  for (size_t k = 0; k < json_object_array_length(changes); k++)
   {
-    int result = sqlite3_step(statement);
-    if (result == SQLITE_DONE)
+    json_object *change = json_object_array_get_idx(changes, k);
+    json_object *flag = json_object_object_get(change, "flag");
+    int result = db_put_flag(global_db, flag, false);
+    if (result == DB_NOT_FOUND)
+      result = db_put_flag(global_db, flag, true);
+    if (result != DB_OK)
     {
-      ff_id = sqlite3_last_insert_rowid(global_db);
+      fprintf(stderr, "replica: failed to apply change %lld\n",
+              (long long)json_object_get_int64(json_object_object_get(change, "version")));
       break;
     }
-    if (result == SQLITE_CONSTRAINT)
-    {
-      fprintf(stderr, "encountered error: %s\n", sqlite3_errmsg(global_db));
-    }
-
-    sqlite3_finalize(statement);
-    req->res.status = 500;
-    req->res.reason = "Failed to make query";
-    h2o_send_inline(req, H2O_STRLIT("N0100 - failed to issue query"));
-    return 1;
+    version = json_object_get_int64(json_object_object_get(change, "version"));
+    n_applied++;
   }
 
-  sqlite3_finalize(statement);
-  sqlite3_exec(global_db, "COMMIT", NULL, NULL, NULL);
-
-  static h2o_generator_t generator = {NULL, NULL};
-  req->res.status = 200;
-  req->res.reason = "OK";
-  req->content_length = SIZE_MAX;
-  h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain; charset=utf-8"));
-  h2o_start_response(req, &generator);
-  h2o_iovec_t vec = h2o_iovec_init(req->entity.base, SIZE_MAX);
-  h2o_send(req, &vec, 1, H2O_SEND_STATE_FINAL);
-  return 0;
+  if (n_applied > 0 && !refresh_plan())
+    fprintf(stderr, "replica: failed to recompile flags\n");
+  loopmon_exit();
+  return version;
 }
 
 static int handle_flag(h2o_handler_t *self, h2o_req_t *req)
@@ -412,7 +936,7 @@ static int create_listener(void)
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htonl(0x7f000001); // 127.0.0.1
-  addr.sin_port = htons(7890);
+  addr.sin_port = htons(port);
 
   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
       setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_flag, sizeof(reuseaddr_flag)) != 0 ||
@@ -0,0 +1,310 @@
+#include "msgpack.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "json-c/json.h"
+
+struct reader
+{
+  const uint8_t *pos;
+  const uint8_t *end;
+};
+
+static bool take(struct reader *r, size_t n, const uint8_t **out)
+{
+  if ((size_t)(r->end - r->pos) < n)
+    return false;
+  *out = r->pos;
+  r->pos += n;
+  return true;
+}
+
+static uint64_t read_be(const uint8_t *p, int n)
+{
+  uint64_t v = 0;
+  for (int k = 0; k < n; k++)
+    v = (v << 8) | p[k];
+  return v;
+}
+
+// Reads an unsigned big-endian length of `n` bytes.
+static bool take_length(struct reader *r, int n, uint32_t *len)
+{
+  const uint8_t *p = NULL;
+  if (!take(r, n, &p))
+    return false;
+  *len = (uint32_t)read_be(p, n);
+  return true;
+}
+
+// Reads a string header and returns its length, or false if the next value
+// isn't a string.
+static bool take_str_header(struct reader *r, uint32_t *len)
+{
+  const uint8_t *p = NULL;
+  if (!take(r, 1, &p))
+    return false;
+  if ((*p & 0xe0) == 0xa0)
+  {
+    *len = *p & 0x1f;
+    return true;
+  }
+  switch (*p)
+  {
+  case 0xd9:
+    return take_length(r, 1, len);
+  case 0xda:
+    return take_length(r, 2, len);
+  case 0xdb:
+    return take_length(r, 4, len);
+  default:
+    return false;
+  }
+}
+
+// Decodes a scalar. Returns false for containers, bin, ext and malformed input.
+// On success `*out` may be NULL, which is how json-c represents `null`.
+static bool decode_scalar(struct reader *r, struct json_object **out)
+{
+  const uint8_t *p = NULL;
+  uint32_t len = 0;
+  *out = NULL;
+  if (r->pos >= r->end)
+    return false;
+
+  uint8_t type = *r->pos;
+  if ((type & 0xe0) == 0xa0 || type == 0xd9 || type == 0xda || type == 0xdb)
+  {
+    if (!take_str_header(r, &len) || !take(r, len, &p))
+      return false;
+    *out = json_object_new_string_len((const char *)p, (int)len);
+    return true;
+  }
+
+  r->pos++;
+  if (type <= 0x7f)
+  {
+    *out = json_object_new_int64(type);
+    return true;
+  }
+  if (type >= 0xe0)
+  {
+    *out = json_object_new_int64((int8_t)type);
+    return true;
+  }
+
+  switch (type)
+  {
+  case 0xc0:
+    return true;
+  case 0xc2:
+  case 0xc3:
+    *out = json_object_new_boolean(type == 0xc3);
+    return true;
+  case 0xca:
+  {
+    if (!take(r, 4, &p))
+      return false;
+    uint32_t bits = (uint32_t)read_be(p, 4);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    *out = json_object_new_double(f);
+    return true;
+  }
+  case 0xcb:
+  {
+    if (!take(r, 8, &p))
+      return false;
+    uint64_t bits = read_be(p, 8);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    *out = json_object_new_double(d);
+    return true;
+  }
+  case 0xcc:
+  case 0xcd:
+  case 0xce:
+  case 0xcf:
+  {
+    int n = 1 << (type - 0xcc);
+    if (!take(r, n, &p))
+      return false;
+    uint64_t v = read_be(p, n);
+    *out = v > INT64_MAX ? json_object_new_uint64(v) : json_object_new_int64((int64_t)v);
+    return true;
+  }
+  case 0xd0:
+  case 0xd1:
+  case 0xd2:
+  case 0xd3:
+  {
+    int n = 1 << (type - 0xd0);
+    if (!take(r, n, &p))
+      return false;
+    uint64_t v = read_be(p, n);
+    // Sign-extend from n bytes.
+    if (n < 8 && (v & (1ULL << (n * 8 - 1))))
+      v |= ~0ULL << (n * 8);
+    *out = json_object_new_int64((int64_t)v);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+struct json_object *msgpack_decode_context(const uint8_t *buf, size_t len)
+{
+  struct reader r = {buf, buf + len};
+  const uint8_t *p = NULL;
+  uint32_t n_entries = 0;
+
+  if (!take(&r, 1, &p))
+    return NULL;
+  if ((*p & 0xf0) == 0x80)
+    n_entries = *p & 0x0f;
+  else if (*p == 0xde)
+  {
+    if (!take_length(&r, 2, &n_entries))
+      return NULL;
+  }
+  else if (*p == 0xdf)
+  {
+    if (!take_length(&r, 4, &n_entries))
+      return NULL;
+  }
+  else
+    return NULL;
+
+  struct json_object *context = json_object_new_object();
+  char key_buf[256];
+  for (uint32_t k = 0; k < n_entries; k++)
+  {
+    uint32_t key_len = 0;
+    const uint8_t *key = NULL;
+    struct json_object *value = NULL;
+    if (!take_str_header(&r, &key_len) || !take(&r, key_len, &key) || !decode_scalar(&r, &value))
+      goto fail;
+
+    // json-c wants NUL-terminated keys.
+    char *key_str = key_len < sizeof(key_buf) ? key_buf : malloc(key_len + 1);
+    if (key_str == NULL)
+    {
+      json_object_put(value);
+      goto fail;
+    }
+    memcpy(key_str, key, key_len);
+    key_str[key_len] = '\0';
+    json_object_object_add(context, key_str, value);
+    if (key_str != key_buf)
+      free(key_str);
+  }
+  if (r.pos != r.end)
+    goto fail;
+  return context;
+
+fail:
+  json_object_put(context);
+  return NULL;
+}
+
+static uint8_t *write_be(uint8_t *dst, uint64_t v, int n)
+{
+  for (int k = n - 1; k >= 0; k--)
+  {
+    dst[k] = (uint8_t)v;
+    v >>= 8;
+  }
+  return dst + n;
+}
+
+uint8_t *msgpack_write_map_header(uint8_t *dst, uint32_t n_entries)
+{
+  if (n_entries <= 0x0f)
+  {
+    *dst++ = 0x80 | n_entries;
+    return dst;
+  }
+  if (n_entries <= 0xffff)
+  {
+    *dst++ = 0xde;
+    return write_be(dst, n_entries, 2);
+  }
+  *dst++ = 0xdf;
+  return write_be(dst, n_entries, 4);
+}
+
+uint8_t *msgpack_write_str(uint8_t *dst, const char *str, uint32_t len)
+{
+  if (len <= 0x1f)
+    *dst++ = 0xa0 | len;
+  else if (len <= 0xff)
+  {
+    *dst++ = 0xd9;
+    dst = write_be(dst, len, 1);
+  }
+  else if (len <= 0xffff)
+  {
+    *dst++ = 0xda;
+    dst = write_be(dst, len, 2);
+  }
+  else
+  {
+    *dst++ = 0xdb;
+    dst = write_be(dst, len, 4);
+  }
+  memcpy(dst, str, len);
+  return dst + len;
+}
+
+uint8_t *msgpack_write_bool(uint8_t *dst, bool value)
+{
+  *dst++ = value ? 0xc3 : 0xc2;
+  return dst;
+}
+
+uint8_t *msgpack_write_nil(uint8_t *dst)
+{
+  *dst++ = 0xc0;
+  return dst;
+}
+
+uint8_t *msgpack_write_int(uint8_t *dst, int64_t value)
+{
+  if (value >= 0 && value <= 0x7f)
+  {
+    *dst++ = (uint8_t)value;
+    return dst;
+  }
+  if (value < 0 && value >= -32)
+  {
+    *dst++ = (uint8_t)(int8_t)value;
+    return dst;
+  }
+  if (value >= INT8_MIN && value <= INT8_MAX)
+  {
+    *dst++ = 0xd0;
+    return write_be(dst, (uint64_t)value, 1);
+  }
+  if (value >= INT16_MIN && value <= INT16_MAX)
+  {
+    *dst++ = 0xd1;
+    return write_be(dst, (uint64_t)value, 2);
+  }
+  if (value >= INT32_MIN && value <= INT32_MAX)
+  {
+    *dst++ = 0xd2;
+    return write_be(dst, (uint64_t)value, 4);
+  }
+  *dst++ = 0xd3;
+  return write_be(dst, (uint64_t)value, 8);
+}
+
+uint8_t *msgpack_write_double(uint8_t *dst, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  *dst++ = 0xcb;
+  return write_be(dst, bits, 8);
+}
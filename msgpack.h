@@ -0,0 +1,31 @@
+#ifndef MSGPACK_H_
+#define MSGPACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct json_object;
+
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
+
+// Largest header any of the writers below emit before their payload.
+#define MSGPACK_MAX_HEADER 9
+
+// Decodes a MessagePack map into the same representation JSON contexts are
+// parsed into: a depth == 1 object with string keys. Values may be nil,
+// booleans, integers, floats or strings; anything else, trailing bytes or a
+// truncated buffer returns NULL. `nil` decodes to a JSON `null`, so the result
+// still has to pass `is_valid_context`.
+struct json_object *msgpack_decode_context(const uint8_t *buf, size_t len);
+
+// Writers. Each writes at most MSGPACK_MAX_HEADER bytes plus its payload to
+// `dst` and returns the position following it.
+uint8_t *msgpack_write_map_header(uint8_t *dst, uint32_t n_entries);
+uint8_t *msgpack_write_str(uint8_t *dst, const char *str, uint32_t len);
+uint8_t *msgpack_write_bool(uint8_t *dst, bool value);
+uint8_t *msgpack_write_nil(uint8_t *dst);
+uint8_t *msgpack_write_int(uint8_t *dst, int64_t value);
+uint8_t *msgpack_write_double(uint8_t *dst, double value);
+
+#endif // MSGPACK_H_
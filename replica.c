@@ -0,0 +1,172 @@
+#include "replica.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h2o/socket/evloop.h"
+#include "json-c/json.h"
+
+static struct
+{
+  h2o_loop_t *loop;
+  h2o_timerwheel_t *timers;
+  h2o_timerwheel_entry_t poll_timer;
+  // Gives up on a poll the primary doesn't finish answering in time.
+  h2o_timerwheel_entry_t deadline_timer;
+  struct sockaddr_in addr;
+  char primary[128];
+  uint64_t interval_ms;
+  replica_apply_cb apply;
+  int64_t version;
+
+  // The request being written; one poll is in flight at a time.
+  char request[256];
+  h2o_socket_t *sock;
+} replica;
+
+static void schedule_poll(uint64_t delay_ms)
+{
+  if (!h2o_timerwheel_is_linked(&replica.poll_timer))
+    h2o_timerwheel_link_abs(replica.timers, &replica.poll_timer, h2o_now(replica.loop) + delay_ms);
+}
+
+// Ends the poll in flight and schedules the next one.
+static void finish_poll(uint64_t delay_ms)
+{
+  if (h2o_timerwheel_is_linked(&replica.deadline_timer))
+    h2o_timerwheel_unlink(&replica.deadline_timer);
+  h2o_socket_close(replica.sock);
+  replica.sock = NULL;
+  schedule_poll(delay_ms);
+}
+
+static void on_deadline(h2o_timerwheel_entry_t *entry)
+{
+  fprintf(stderr, "replica: primary did not respond within %d ms\n", REPLICA_TIMEOUT_MS);
+  finish_poll(replica.interval_ms);
+}
+
+// Parses a complete HTTP/1.0 response from the primary and applies its
+// changes. Returns whether the primary has more changes waiting.
+static bool handle_response(const char *bytes, size_t len)
+{
+  if (len < sizeof("HTTP/1.x 200") - 1 || !h2o_memis(bytes + sizeof("HTTP/1.x") - 1, 4, H2O_STRLIT(" 200")))
+  {
+    fprintf(stderr, "replica: unexpected response from primary\n");
+    return false;
+  }
+  size_t header_end = h2o_strstr(bytes, len, H2O_STRLIT("\r\n\r\n"));
+  if (header_end == SIZE_MAX)
+    return false;
+  const char *body = bytes + header_end + 4;
+
+  json_tokener *tokener = json_tokener_new();
+  struct json_object *response = json_tokener_parse_ex(tokener, body, (int)(len - (body - bytes)));
+  json_tokener_free(tokener);
+
+  struct json_object *changes = NULL;
+  struct json_object *more = NULL;
+  if (response == NULL || !json_object_object_get_ex(response, "changes", &changes) ||
+      !json_object_is_type(changes, json_type_array))
+  {
+    fprintf(stderr, "replica: malformed change log from primary\n");
+    json_object_put(response);
+    return false;
+  }
+
+  // If nothing in a non-empty batch applied, retry on the regular interval
+  // rather than spinning on it.
+  int64_t applied = replica.apply(changes, replica.version);
+  bool stuck = applied == replica.version && json_object_array_length(changes) > 0;
+  replica.version = applied;
+  bool has_more = !stuck && json_object_object_get_ex(response, "more", &more) && json_object_get_boolean(more);
+  json_object_put(response);
+  return has_more;
+}
+
+static void on_response(h2o_socket_t *sock, const char *err)
+{
+  // The primary closes the connection once the response is complete.
+  if (err == NULL)
+    return;
+
+  bool has_more = handle_response(sock->input->bytes, sock->input->size);
+  finish_poll(has_more ? 0 : replica.interval_ms);
+}
+
+static void on_request_written(h2o_socket_t *sock, const char *err)
+{
+  if (err != NULL)
+  {
+    fprintf(stderr, "replica: failed to send request to primary: %s\n", err);
+    finish_poll(replica.interval_ms);
+    return;
+  }
+  h2o_socket_read_start(sock, on_response);
+}
+
+static void on_connect(h2o_socket_t *sock, const char *err)
+{
+  if (err != NULL)
+  {
+    fprintf(stderr, "replica: failed to connect to primary: %s\n", err);
+    finish_poll(replica.interval_ms);
+    return;
+  }
+
+  // HTTP/1.0 so that the primary neither keeps the connection alive nor
+  // chunks the body.
+  int len = snprintf(replica.request, sizeof(replica.request),
+                     "GET /changes?since=%lld HTTP/1.0\r\nHost: %s\r\n\r\n",
+                     (long long)replica.version, replica.primary);
+  h2o_iovec_t buf = h2o_iovec_init(replica.request, len);
+  h2o_socket_write(sock, &buf, 1, on_request_written);
+}
+
+static void poll_primary(h2o_timerwheel_entry_t *entry)
+{
+  const char *err = NULL;
+  replica.sock = h2o_socket_connect(replica.loop, (struct sockaddr *)&replica.addr, sizeof(replica.addr), on_connect, &err);
+  if (replica.sock == NULL)
+  {
+    fprintf(stderr, "replica: failed to connect to primary: %s\n", err);
+    schedule_poll(replica.interval_ms);
+    return;
+  }
+  // Covers connecting, sending the request and reading the whole response.
+  h2o_timerwheel_link_abs(replica.timers, &replica.deadline_timer, h2o_now(replica.loop) + REPLICA_TIMEOUT_MS);
+}
+
+int replica_start(h2o_loop_t *loop, h2o_timerwheel_t *timers, const char *primary, uint64_t interval_ms, replica_apply_cb apply)
+{
+  const char *colon = strrchr(primary, ':');
+  char host[64];
+  if (colon == NULL || (size_t)(colon - primary) >= sizeof(host) || strlen(primary) >= sizeof(replica.primary))
+    return -1;
+  memcpy(host, primary, colon - primary);
+  host[colon - primary] = '\0';
+
+  memset(&replica.addr, 0, sizeof(replica.addr));
+  replica.addr.sin_family = AF_INET;
+  replica.addr.sin_port = htons(atoi(colon + 1));
+  if (inet_pton(AF_INET, host, &replica.addr.sin_addr) != 1 || replica.addr.sin_port == 0)
+    return -1;
+
+  replica.loop = loop;
+  replica.timers = timers;
+  replica.interval_ms = interval_ms;
+  replica.apply = apply;
+  replica.version = 0;
+  strcpy(replica.primary, primary);
+  h2o_timerwheel_init_entry(&replica.poll_timer, poll_primary);
+  h2o_timerwheel_init_entry(&replica.deadline_timer, on_deadline);
+  schedule_poll(0);
+  return 0;
+}
+
+int64_t replica_version(void)
+{
+  return replica.version;
+}
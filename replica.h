@@ -0,0 +1,27 @@
+#ifndef REPLICA_H_
+#define REPLICA_H_
+
+#include <stdint.h>
+
+#include "h2o.h"
+
+struct json_object;
+
+// A poll the primary hasn't answered in full after this long is abandoned and
+// retried on the regular interval.
+#define REPLICA_TIMEOUT_MS 5000
+
+// Applies a batch of changes from the primary's `/changes` endpoint, oldest
+// first. Returns the version of the last change applied, which the next poll
+// continues from.
+typedef int64_t (*replica_apply_cb)(struct json_object *changes, int64_t version);
+
+// Follow the change log of the fastforward process at `primary` ("host:port").
+// Polls every `interval_ms`, or right away while the primary reports more
+// changes than fit in one batch. Only one replica may run per process.
+int replica_start(h2o_loop_t *loop, h2o_timerwheel_t *timers, const char *primary, uint64_t interval_ms, replica_apply_cb apply);
+
+// Version of the last change applied from the primary.
+int64_t replica_version(void);
+
+#endif // REPLICA_H_
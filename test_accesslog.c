@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity/unity.h"
+#include "json-c/json.h"
+
+#include "accesslog.h"
+
+static int pipe_fds[2];
+static h2o_globalconf_t config;
+static h2o_logger_t *logger = NULL;
+
+// Everything the access log wrote, one JSON object per line.
+static char output[64 * 1024];
+static struct json_object *lines[256];
+static int n_lines = 0;
+
+void setUp(void)
+{
+  TEST_ASSERT_EQUAL(0, pipe(pipe_fds));
+  h2o_config_init(&config);
+  h2o_hostconf_t *hostconf = h2o_config_register_host(&config, h2o_iovec_init(H2O_STRLIT("default")), 65535);
+  h2o_pathconf_t *pathconf = h2o_config_register_path(hostconf, "/", 0);
+  access_log_register(pathconf);
+  logger = pathconf->loggers.entries[0];
+}
+
+void tearDown(void)
+{
+  for (int k = 0; k < n_lines; k++)
+    json_object_put(lines[k]);
+  n_lines = 0;
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  h2o_config_dispose(&config);
+}
+
+static void log_requests(int n_requests, const char *path)
+{
+  for (int k = 0; k < n_requests; k++)
+  {
+    h2o_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.method = h2o_iovec_init(H2O_STRLIT("POST"));
+    req.path = h2o_iovec_init(path, strlen(path));
+    req.res.status = 200;
+    req.bytes_sent = 17;
+    req.timestamps.request_begin_at.tv_sec = 1700000000;
+    req.timestamps.response_end_at.tv_sec = 1700000000;
+    req.timestamps.response_end_at.tv_usec = 85;
+    logger->log_access(logger, &req);
+  }
+}
+
+// Stops the access log and parses what it wrote.
+static void collect(void)
+{
+  access_log_stop();
+  close(pipe_fds[1]);
+  pipe_fds[1] = -1;
+
+  ssize_t len = read(pipe_fds[0], output, sizeof(output) - 1);
+  TEST_ASSERT_TRUE(len >= 0);
+  output[len] = '\0';
+  for (char *line = strtok(output, "\n"); line != NULL && n_lines < 256; line = strtok(NULL, "\n"))
+  {
+    lines[n_lines] = json_tokener_parse(line);
+    TEST_ASSERT_NOT_NULL(lines[n_lines]);
+    n_lines++;
+  }
+}
+
+void test_writes_json_lines(void)
+{
+  TEST_ASSERT_EQUAL(0, access_log_start(pipe_fds[1], ACCESS_LOG_BUFFER_SIZE, 1));
+  log_requests(3, "/evaluate/\"quoted\"\n");
+  collect();
+
+  TEST_ASSERT_EQUAL(3, n_lines);
+  TEST_ASSERT_EQUAL_STRING("/evaluate/\"quoted\"\n", json_object_get_string(json_object_object_get(lines[0], "path")));
+  TEST_ASSERT_EQUAL_STRING("POST", json_object_get_string(json_object_object_get(lines[0], "method")));
+  TEST_ASSERT_EQUAL(200, json_object_get_int(json_object_object_get(lines[0], "status")));
+  TEST_ASSERT_EQUAL(85, json_object_get_int(json_object_object_get(lines[2], "us")));
+}
+
+void test_long_escaped_path(void)
+{
+  // Each byte is escaped to six, which is more than fits in a line.
+  char path[201];
+  memset(path, 0xc3, sizeof(path) - 1);
+  path[sizeof(path) - 1] = '\0';
+
+  TEST_ASSERT_EQUAL(0, access_log_start(pipe_fds[1], ACCESS_LOG_BUFFER_SIZE, 1));
+  log_requests(2, path);
+  collect();
+
+  // The path is cut short, but the lines are whole.
+  TEST_ASSERT_EQUAL(2, n_lines);
+  const char *logged = json_object_get_string(json_object_object_get(lines[0], "path"));
+  TEST_ASSERT_TRUE(strlen(logged) > 0 && strlen(logged) < 2 * (sizeof(path) - 1));
+  TEST_ASSERT_EQUAL_MEMORY("\xc3\x83", logged, 2);
+  TEST_ASSERT_EQUAL(200, json_object_get_int(json_object_object_get(lines[1], "status")));
+  TEST_ASSERT_EQUAL(17, json_object_get_int(json_object_object_get(lines[1], "bytes")));
+  TEST_ASSERT_EQUAL(85, json_object_get_int(json_object_object_get(lines[1], "us")));
+}
+
+void test_sampling(void)
+{
+  TEST_ASSERT_EQUAL(0, access_log_start(pipe_fds[1], ACCESS_LOG_BUFFER_SIZE, 4));
+  log_requests(100, "/ping");
+  collect();
+  TEST_ASSERT_EQUAL(25, n_lines);
+}
+
+void test_counts_drops(void)
+{
+  // Room for a handful of lines between flushes.
+  TEST_ASSERT_EQUAL(0, access_log_start(pipe_fds[1], 0, 1));
+  log_requests(100, "/ping");
+  collect();
+
+  // Drops are reported as they happen, so there may be several reports.
+  int logged = 0;
+  int64_t reported = 0;
+  for (int k = 0; k < n_lines; k++)
+  {
+    struct json_object *dropped = NULL;
+    if (json_object_object_get_ex(lines[k], "dropped", &dropped))
+      reported += json_object_get_int64(dropped);
+    else
+      logged++;
+  }
+  TEST_ASSERT_TRUE(reported > 0);
+  TEST_ASSERT_EQUAL(access_log_dropped(), reported);
+  TEST_ASSERT_EQUAL(100, logged + reported);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_writes_json_lines);
+  RUN_TEST(test_long_escaped_path);
+  RUN_TEST(test_sampling);
+  RUN_TEST(test_counts_drops);
+  return UNITY_END();
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "unity/unity.h"
+#include "json-c/json.h"
+
+#include "batch.h"
+#include "evaluation.h"
+
+#define MALFORMED "{\"error\":\"N0004 - malformed request body\"}\n"
+#define BOTH_ON "{\"payments\":true,\"checkout\":true}\n"
+#define CHECKOUT_OFF "{\"payments\":true,\"checkout\":false}\n"
+
+static struct evaluation_plan *plan = NULL;
+static struct batch batch;
+static char output[4096];
+
+void setUp(void)
+{
+  struct json_object *rule = json_tokener_parse("{ \"country\": [\"US\"] }");
+  const struct flag_definition flags[] = {
+      {.id = 1, .key = "checkout", .rule = rule},
+      {.id = 2, .key = "payments", .enabled = true},
+  };
+  const struct flag_prerequisite prerequisites[] = {{.flag_id = 1, .prerequisite_id = 2}};
+  plan = compile_evaluation_plan(flags, 2, prerequisites, 1);
+  json_object_put(rule);
+  batch_init(&batch, NULL);
+}
+
+void tearDown(void)
+{
+  batch_dispose(&batch);
+  free_evaluation_plan(plan);
+}
+
+static void feed(const char *chunk, bool is_end_stream)
+{
+  TEST_ASSERT_EQUAL(strlen(chunk), batch_evaluate_chunk(&batch, plan, chunk, strlen(chunk), is_end_stream));
+}
+
+// Result lines so far, taking them out of `pending`.
+static const char *take(void)
+{
+  size_t len = batch.pending->size < sizeof(output) - 1 ? batch.pending->size : sizeof(output) - 1;
+  if (len == 0)
+    return "";
+  memcpy(output, batch.pending->bytes, len);
+  output[len] = '\0';
+  h2o_buffer_consume(&batch.pending, batch.pending->size);
+  return output;
+}
+
+void test_line_split_across_chunks(void)
+{
+  feed("{ \"coun", false);
+  TEST_ASSERT_EQUAL_STRING("", take());
+  feed("try\": \"US\" }\n", false);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON, take());
+}
+
+void test_carries_partial_line_over(void)
+{
+  feed("{ \"country\": \"US\" }\n{ \"country\": ", false);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON, take());
+  TEST_ASSERT_TRUE(batch.partial->size != 0);
+
+  feed("\"CA\" }\n", false);
+  TEST_ASSERT_EQUAL_STRING(CHECKOUT_OFF, take());
+  TEST_ASSERT_EQUAL(0, batch.partial->size);
+}
+
+void test_crlf_and_blank_lines(void)
+{
+  feed("\r\n\n{ \"country\": \"US\" }\r\n  \r\n{ \"country\": \"CA\" }\r\n", true);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON CHECKOUT_OFF, take());
+}
+
+void test_final_line_without_newline(void)
+{
+  feed("{ \"country\": \"CA\" }\n{ \"country\": \"US\" }", false);
+  TEST_ASSERT_EQUAL_STRING(CHECKOUT_OFF, take());
+  feed("", true);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON, take());
+}
+
+void test_error_lines(void)
+{
+  feed("not json\n"
+       "{ \"country\": \"US\" } garbage\n"
+       "{ \"country\": \"US\" }  \n"
+       "[1]\n"
+       "{ \"country\": { \"code\": \"US\" } }\n"
+       "{ \"country\": \"US\"",
+       true);
+  TEST_ASSERT_EQUAL_STRING(MALFORMED MALFORMED BOTH_ON MALFORMED MALFORMED MALFORMED, take());
+}
+
+void test_line_too_long(void)
+{
+  // Over the limit across several chunks, then a line that fits.
+  static char chunk[BATCH_MAX_LINE / 2 + 1];
+  memset(chunk, ' ', sizeof(chunk) - 1);
+  chunk[0] = '{';
+  for (int k = 0; k < 3; k++)
+    feed(chunk, false);
+  TEST_ASSERT_EQUAL_STRING("{\"error\":\"N0009 - line too long\"}\n", take());
+  TEST_ASSERT_EQUAL(0, batch.partial->size);
+
+  feed(chunk, false);
+  feed("}\n{ \"country\": \"US\" }\n", true);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON, take());
+}
+
+void test_stops_at_high_water(void)
+{
+  static char chunk[BATCH_PENDING_HIGH_WATER * 2];
+  const char line[] = "{ \"country\": \"US\" }\n";
+  size_t len = 0;
+  for (; len + sizeof(line) - 1 < sizeof(chunk); len += sizeof(line) - 1)
+    memcpy(chunk + len, line, sizeof(line) - 1);
+
+  // Each line is taken whole, and output never runs more than a result line
+  // over the mark.
+  int n_results = 0;
+  size_t taken = 0;
+  while (taken < len)
+  {
+    size_t step = batch_evaluate_chunk(&batch, plan, chunk + taken, len - taken, true);
+    TEST_ASSERT_TRUE(step > 0 && step % (sizeof(line) - 1) == 0);
+    TEST_ASSERT_TRUE(batch.pending->size < BATCH_PENDING_HIGH_WATER + sizeof(BOTH_ON));
+    n_results += batch.pending->size / (sizeof(BOTH_ON) - 1);
+    h2o_buffer_consume(&batch.pending, batch.pending->size);
+    taken += step;
+  }
+  TEST_ASSERT_EQUAL(len / (sizeof(line) - 1), n_results);
+}
+
+void test_single_flag(void)
+{
+  batch.key = "checkout";
+  feed("{ \"country\": \"US\" }\n", false);
+  TEST_ASSERT_EQUAL_STRING(BOTH_ON, take());
+
+  // The flag was deleted between chunks.
+  batch.key = "missing";
+  feed("{ \"country\": \"US\" }\n", true);
+  TEST_ASSERT_EQUAL_STRING("{\"error\":\"N0005 - no such flag\"}\n", take());
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_line_split_across_chunks);
+  RUN_TEST(test_carries_partial_line_over);
+  RUN_TEST(test_crlf_and_blank_lines);
+  RUN_TEST(test_final_line_without_newline);
+  RUN_TEST(test_error_lines);
+  RUN_TEST(test_line_too_long);
+  RUN_TEST(test_stops_at_high_water);
+  RUN_TEST(test_single_flag);
+  return UNITY_END();
+}
@@ -5,6 +5,7 @@
 #include "json-c/json.h"
 
 #include "db.h"
+#include "evaluation.h"
 
 static sqlite3 *global_db = NULL;
 
@@ -76,10 +77,188 @@ void test_record_context(void)
   TEST_ASSERT_EQUAL(1, nrows);
 }
 
+static int64_t query_int(const char *sql)
+{
+  sqlite3_stmt *statement = NULL;
+  int64_t value = -1;
+  if (sqlite3_prepare_v2(global_db, sql, -1, &statement, NULL) == SQLITE_OK && sqlite3_step(statement) == SQLITE_ROW)
+    value = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  return value;
+}
+
+void test_record_context_values(void)
+{
+  struct json_object *context = json_tokener_parse("{ \"country\": \"US\", \"beta\": true }");
+  int64_t now = 10 * CONTEXT_BUCKET_SECONDS + 5;
+  TEST_ASSERT_TRUE(record_context_metrics_at(global_db, context, now));
+  TEST_ASSERT_TRUE(record_context_metrics_at(global_db, context, now + 1));
+  TEST_ASSERT_EQUAL(2, query_int("SELECT COUNT(*) FROM request_meta_key"));
+  TEST_ASSERT_EQUAL(2, query_int("SELECT COUNT(*) FROM request_meta_values"));
+  TEST_ASSERT_EQUAL(1, query_int("SELECT n_observed FROM request_meta_values WHERE key_name = '\"US\"'"));
+  TEST_ASSERT_EQUAL(10 * CONTEXT_BUCKET_SECONDS, query_int("SELECT last_seen FROM request_meta_values WHERE key_name = '\"US\"'"));
+
+  // Seen again in the next bucket.
+  TEST_ASSERT_TRUE(record_context_metrics_at(global_db, context, now + CONTEXT_BUCKET_SECONDS));
+  TEST_ASSERT_EQUAL(2, query_int("SELECT n_observed FROM request_meta_values WHERE key_name = '\"US\"'"));
+  TEST_ASSERT_EQUAL(11 * CONTEXT_BUCKET_SECONDS, query_int("SELECT last_seen FROM request_meta_key WHERE key_name = 'country'"));
+  json_object_put(context);
+}
+
+void test_purge_context_metrics(void)
+{
+  struct json_object *old = json_tokener_parse("{ \"country\": \"US\", \"plan\": \"free\", \"bound\": 1 }");
+  struct json_object *fresh = json_tokener_parse("{ \"country\": \"CA\" }");
+  int64_t day = 24 * 3600;
+  TEST_ASSERT_TRUE(record_context_metrics_at(global_db, old, 0));
+  TEST_ASSERT_TRUE(record_context_metrics_at(global_db, fresh, 10 * day));
+  TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(global_db,
+                                            "INSERT INTO feature_flags (name, key) VALUES ('f', 'f');"
+                                            "INSERT INTO flags_meta (flag_id, meta_key_id) "
+                                            "SELECT 1, id FROM request_meta_key WHERE key_name = 'bound'",
+                                            NULL, NULL, NULL));
+
+  // Batches stop at the limit.
+  TEST_ASSERT_EQUAL(2, db_purge_context_metrics(global_db, 10 * day, 7 * day, 5 * day, 2));
+  TEST_ASSERT_EQUAL(2, query_int("SELECT COUNT(*) FROM request_meta_values"));
+
+  // Values go first, then keys with nothing left, except those bound to flags.
+  TEST_ASSERT_EQUAL(2, db_purge_context_metrics(global_db, 10 * day, 7 * day, 5 * day, 10));
+  TEST_ASSERT_EQUAL(0, db_purge_context_metrics(global_db, 10 * day, 7 * day, 5 * day, 10));
+  TEST_ASSERT_EQUAL(1, query_int("SELECT COUNT(*) FROM request_meta_values"));
+  TEST_ASSERT_EQUAL(2, query_int("SELECT COUNT(*) FROM request_meta_key"));
+  TEST_ASSERT_EQUAL(0, query_int("SELECT COUNT(*) FROM request_meta_key WHERE key_name = 'plan'"));
+  TEST_ASSERT_EQUAL(1, query_int("SELECT COUNT(*) FROM request_meta_key WHERE key_name = 'bound'"));
+
+  // A TTL of 0 keeps everything.
+  TEST_ASSERT_EQUAL(0, db_purge_context_metrics(global_db, 100 * day, 0, 0, 10));
+  TEST_ASSERT_EQUAL(DB_OK, db_incremental_vacuum(global_db, 8));
+  json_object_put(old);
+  json_object_put(fresh);
+}
+
+static int n_statements = 0;
+
+static void count_statement(const char *sql)
+{
+  n_statements++;
+}
+
+void test_observe_statements(void)
+{
+  db_observe_statements(count_statement);
+  TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(global_db, "SELECT 1; SELECT 2", NULL, NULL, NULL));
+  db_observe_statements(NULL);
+  TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(global_db, "SELECT 3", NULL, NULL, NULL));
+  TEST_ASSERT_EQUAL(2, n_statements);
+}
+
+void test_put_flag_rejects_cycles(void)
+{
+  struct json_object *flag = json_tokener_parse("{ \"key\": \"payments\" }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  flag = json_tokener_parse("{ \"key\": \"checkout-v2\", \"prerequisites\": [\"payments\"] }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  TEST_ASSERT_EQUAL(DB_CONFLICT, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  flag = json_tokener_parse("{ \"key\": \"payments\", \"prerequisites\": [\"checkout-v2\"] }");
+  TEST_ASSERT_EQUAL(DB_CYCLE, db_put_flag(global_db, flag, false));
+  json_object_put(flag);
+
+  flag = json_tokener_parse("{ \"key\": \"payments\", \"prerequisites\": [\"missing\"] }");
+  TEST_ASSERT_EQUAL(DB_INVALID, db_put_flag(global_db, flag, false));
+  json_object_put(flag);
+
+  TEST_ASSERT_EQUAL(SQLITE_OK, dbexec("SELECT * FROM feature_flag_prerequisites"));
+  TEST_ASSERT_EQUAL(1, nrows);
+}
+
+void test_load_evaluation_plan(void)
+{
+  struct json_object *flag = json_tokener_parse("{ \"key\": \"payments\", \"enabled\": true }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  flag = json_tokener_parse("{ \"key\": \"checkout-v2\", \"rule\": { \"beta\": true }, \"prerequisites\": [\"payments\"] }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  struct evaluation_plan *plan = db_load_evaluation_plan(global_db);
+  TEST_ASSERT_NOT_NULL(plan);
+  TEST_ASSERT_EQUAL(2, plan->n_steps);
+
+  bool results[2];
+  struct json_object *context = json_tokener_parse("{ \"beta\": true }");
+  TEST_ASSERT_TRUE(evaluate_plan(plan, find_plan_step(plan, "checkout-v2"), context, results));
+  json_object_put(context);
+  free_evaluation_plan(plan);
+}
+
+void test_prerequisite_key_with_spaces(void)
+{
+  struct json_object *flag = json_tokener_parse("{ \"key\": \"checkout v2\", \"enabled\": false }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  // Refers to "checkout-v2" the way it was written.
+  flag = json_tokener_parse("{ \"key\": \"checkout-v3\", \"enabled\": true, \"prerequisites\": [\"checkout v2\"] }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+  TEST_ASSERT_EQUAL(SQLITE_OK, dbexec("SELECT * FROM feature_flag_prerequisites"));
+  TEST_ASSERT_EQUAL(1, nrows);
+
+  struct evaluation_plan *plan = db_load_evaluation_plan(global_db);
+  TEST_ASSERT_NOT_NULL(plan);
+  bool results[2];
+  TEST_ASSERT_FALSE(evaluate_plan(plan, find_plan_step(plan, "checkout-v3"), NULL, results));
+  free_evaluation_plan(plan);
+}
+
+void test_changes_since(void)
+{
+  struct json_object *flag = json_tokener_parse("{ \"key\": \"payments\", \"enabled\": true }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  flag = json_tokener_parse("{ \"key\": \"checkout-v2\", \"prerequisites\": [\"payments\"] }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, true));
+  json_object_put(flag);
+
+  // Updates are logged as the full document, not just the changed fields.
+  flag = json_tokener_parse("{ \"key\": \"checkout-v2\", \"name\": \"Checkout v2\" }");
+  TEST_ASSERT_EQUAL(DB_OK, db_put_flag(global_db, flag, false));
+  json_object_put(flag);
+
+  struct json_object *changes = NULL;
+  TEST_ASSERT_EQUAL(DB_OK, db_changes_since(global_db, 1, 100, &changes));
+  TEST_ASSERT_EQUAL(2, json_object_array_length(changes));
+
+  struct json_object *last = json_object_array_get_idx(changes, 1);
+  TEST_ASSERT_EQUAL(3, json_object_get_int64(json_object_object_get(last, "version")));
+  struct json_object *document = json_object_object_get(last, "flag");
+  TEST_ASSERT_EQUAL_STRING("Checkout v2", json_object_get_string(json_object_object_get(document, "name")));
+  TEST_ASSERT_EQUAL(1, json_object_array_length(json_object_object_get(document, "prerequisites")));
+  json_object_put(changes);
+
+  TEST_ASSERT_EQUAL(DB_OK, db_changes_since(global_db, 3, 100, &changes));
+  TEST_ASSERT_EQUAL(0, json_object_array_length(changes));
+  json_object_put(changes);
+}
+
 int main(void)
 {
   UNITY_BEGIN();
   RUN_TEST(test_smoke);
   RUN_TEST(test_record_context);
+  RUN_TEST(test_record_context_values);
+  RUN_TEST(test_purge_context_metrics);
+  RUN_TEST(test_observe_statements);
+  RUN_TEST(test_put_flag_rejects_cycles);
+  RUN_TEST(test_load_evaluation_plan);
+  RUN_TEST(test_prerequisite_key_with_spaces);
+  RUN_TEST(test_changes_since);
   return UNITY_END();
 }
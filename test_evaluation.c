@@ -1,9 +1,14 @@
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "unity/unity.h"
 #include "json-c/json.h"
 
+#include "common.h"
+#include "db.h"
 #include "evaluation.h"
+#include "libfastforward.h"
 
 void setUp(void)
 {
@@ -76,6 +81,400 @@ void test_is_valid_rule(void)
   json_object_put(invalid_rule);
 }
 
+// checkout-v3 requires checkout-v2, which requires payments.
+static struct evaluation_plan *checkout_plan(bool payments_enabled)
+{
+  struct flag_definition flags[] = {
+      {3, "checkout-v3", NULL, true},
+      {1, "payments", NULL, payments_enabled},
+      {2, "checkout-v2", NULL, true},
+      {4, "unrelated", NULL, true},
+  };
+  struct flag_prerequisite prerequisites[] = {
+      {3, 2},
+      {2, 1},
+  };
+  return compile_evaluation_plan(flags, 4, prerequisites, 2);
+}
+
+void test_plan_orders_prerequisites_first(void)
+{
+  struct evaluation_plan *plan = checkout_plan(true);
+  TEST_ASSERT_NOT_NULL(plan);
+  TEST_ASSERT_EQUAL(4, plan->n_steps);
+
+  int payments = find_plan_step(plan, "payments");
+  int v2 = find_plan_step(plan, "checkout-v2");
+  int v3 = find_plan_step(plan, "checkout-v3");
+  TEST_ASSERT_TRUE(payments < v2);
+  TEST_ASSERT_TRUE(v2 < v3);
+  TEST_ASSERT_EQUAL(-1, find_plan_step(plan, "missing"));
+
+  const struct plan_step *step = &plan->steps[v3];
+  TEST_ASSERT_EQUAL(3, step->n_closure);
+  TEST_ASSERT_EQUAL(payments, step->closure[0]);
+  TEST_ASSERT_EQUAL(v2, step->closure[1]);
+  TEST_ASSERT_EQUAL(v3, step->closure[2]);
+
+  free_evaluation_plan(plan);
+}
+
+void test_plan_prerequisite_gates_flag(void)
+{
+  struct json_object *context = json_tokener_parse("{ \"userId\": 5 }");
+  bool results[4];
+
+  struct evaluation_plan *plan = checkout_plan(true);
+  TEST_ASSERT_TRUE(evaluate_plan(plan, find_plan_step(plan, "checkout-v3"), context, results));
+  free_evaluation_plan(plan);
+
+  plan = checkout_plan(false);
+  TEST_ASSERT_FALSE(evaluate_plan(plan, find_plan_step(plan, "checkout-v3"), context, results));
+  TEST_ASSERT_FALSE(results[find_plan_step(plan, "checkout-v2")]);
+
+  evaluate_plan_all(plan, context, results);
+  TEST_ASSERT_TRUE(results[find_plan_step(plan, "unrelated")]);
+  TEST_ASSERT_FALSE(results[find_plan_step(plan, "checkout-v3")]);
+  free_evaluation_plan(plan);
+
+  json_object_put(context);
+}
+
+void test_plan_uses_rules(void)
+{
+  struct json_object *rule = json_tokener_parse("{ \"country\": [\"US\", \"CA\"] }");
+  struct flag_definition flags[] = {
+      {1, "north-america", rule, false},
+      {2, "checkout-v2", NULL, true},
+  };
+  struct flag_prerequisite prerequisites[] = {{2, 1}};
+  struct evaluation_plan *plan = compile_evaluation_plan(flags, 2, prerequisites, 1);
+  json_object_put(rule);
+  TEST_ASSERT_NOT_NULL(plan);
+
+  bool results[2];
+  struct json_object *context = json_tokener_parse("{ \"country\": \"CA\" }");
+  TEST_ASSERT_TRUE(evaluate_plan(plan, find_plan_step(plan, "checkout-v2"), context, results));
+  json_object_put(context);
+
+  context = json_tokener_parse("{ \"country\": \"DE\" }");
+  TEST_ASSERT_FALSE(evaluate_plan(plan, find_plan_step(plan, "checkout-v2"), context, results));
+  json_object_put(context);
+
+  free_evaluation_plan(plan);
+}
+
+void test_plan_rejects_cycles(void)
+{
+  struct flag_definition flags[] = {
+      {1, "a", NULL, true},
+      {2, "b", NULL, true},
+      {3, "c", NULL, true},
+  };
+  struct flag_prerequisite cycle[] = {{1, 2}, {2, 3}, {3, 1}};
+  TEST_ASSERT_NULL(compile_evaluation_plan(flags, 3, cycle, 3));
+
+  struct flag_prerequisite self[] = {{1, 1}};
+  TEST_ASSERT_NULL(compile_evaluation_plan(flags, 3, self, 1));
+
+  struct flag_prerequisite unknown[] = {{1, 9}};
+  TEST_ASSERT_NULL(compile_evaluation_plan(flags, 3, unknown, 1));
+}
+
+void test_explain_plan(void)
+{
+  struct json_object *rule = json_tokener_parse("{ \"country\": [\"US\", \"CA\"], \"plan\": \"pro\" }");
+  struct flag_definition flags[] = {
+      {1, "payments", NULL, true},
+      {2, "checkout-v2", rule, false},
+  };
+  struct flag_prerequisite prerequisites[] = {{2, 1}};
+  struct evaluation_plan *plan = compile_evaluation_plan(flags, 2, prerequisites, 1);
+  json_object_put(rule);
+
+  bool results[2];
+  struct json_object *context = json_tokener_parse("{ \"country\": \"CA\", \"plan\": \"free\" }");
+  struct json_object *explain = explain_plan(plan, find_plan_step(plan, "checkout-v2"), context, results);
+  TEST_ASSERT_EQUAL(2, json_object_array_length(explain));
+
+  struct json_object *payments = json_object_array_get_idx(explain, 0);
+  TEST_ASSERT_EQUAL_STRING("payments", json_object_get_string(json_object_object_get(payments, "flag")));
+  TEST_ASSERT_TRUE(json_object_get_boolean(json_object_object_get(payments, "default")));
+
+  // Both rule keys are checked; the array is scanned in full and the scalar
+  // doesn't match.
+  struct json_object *checkout = json_object_array_get_idx(explain, 1);
+  struct json_object *checks = json_object_object_get(checkout, "rule");
+  TEST_ASSERT_EQUAL(2, json_object_array_length(checks));
+  TEST_ASSERT_EQUAL(2, json_object_get_int(json_object_object_get(json_object_array_get_idx(checks, 0), "scanned")));
+  TEST_ASSERT_FALSE(json_object_get_boolean(json_object_object_get(json_object_array_get_idx(checks, 1), "matched")));
+  TEST_ASSERT_FALSE(json_object_get_boolean(json_object_object_get(checkout, "result")));
+  TEST_ASSERT_FALSE(results[find_plan_step(plan, "checkout-v2")]);
+
+  json_object_put(explain);
+  json_object_put(context);
+  free_evaluation_plan(plan);
+}
+
+// Conformance cases, run against both the server (flags written with
+// `db_put_flag` and evaluated from the plan it loads) and libfastforward.
+struct conformance_case
+{
+  // Flag documents, written in order. A key written twice is updated.
+  const char *flags;
+  const char *context;
+  // Expected state of each flag.
+  const char *expected;
+  // Result of writing the last document, if it should fail.
+  int rejected;
+};
+
+static const struct conformance_case conformance_cases[] = {
+    {"[{\"key\": \"on\", \"enabled\": true}, {\"key\": \"off\"}]",
+     "{}",
+     "{\"on\": true, \"off\": false}"},
+    {"[{\"key\": \"us\", \"rule\": {\"country\": \"US\"}}, {\"key\": \"ca\", \"rule\": {\"country\": \"CA\"}}]",
+     "{\"country\": \"US\"}",
+     "{\"us\": true, \"ca\": false}"},
+    {"[{\"key\": \"north-america\", \"rule\": {\"country\": [\"US\", \"CA\"]}}]",
+     "{\"country\": \"CA\"}",
+     "{\"north-america\": true}"},
+    {"[{\"key\": \"missing-key\", \"enabled\": true, \"rule\": {\"country\": \"US\"}}]",
+     "{\"plan\": \"pro\"}",
+     "{\"missing-key\": false}"},
+    {"[{\"key\": \"pro\", \"enabled\": true, \"rule\": {\"plan\": \"pro\", \"seats\": [5, 10]}}]",
+     "{\"plan\": \"pro\", \"seats\": 10}",
+     "{\"pro\": true}"},
+    {"[{\"key\": \"beta\", \"rule\": {\"beta\": true}},"
+     " {\"key\": \"checkout-v2\", \"enabled\": true, \"prerequisites\": [\"beta\"]},"
+     " {\"key\": \"checkout-v3\", \"enabled\": true, \"prerequisites\": [\"checkout-v2\"]}]",
+     "{\"beta\": false}",
+     "{\"beta\": false, \"checkout-v2\": false, \"checkout-v3\": false}"},
+    {"[{\"key\": \"beta\", \"rule\": {\"beta\": true}},"
+     " {\"key\": \"checkout-v2\", \"enabled\": true, \"prerequisites\": [\"beta\"]},"
+     " {\"key\": \"checkout-v3\", \"enabled\": true, \"prerequisites\": [\"checkout-v2\"]}]",
+     "{\"beta\": true}",
+     "{\"beta\": true, \"checkout-v2\": true, \"checkout-v3\": true}"},
+    {"[{\"key\": \"kept\", \"enabled\": true, \"rule\": {\"plan\": \"pro\"}}, {\"key\": \"kept\", \"rule\": null}]",
+     "{\"plan\": \"free\"}",
+     "{\"kept\": true}"},
+    {"[{\"key\": \"new checkout\", \"enabled\": true}]",
+     "{}",
+     "{\"new-checkout\": true}"},
+    {"[{\"key\": \"new payments\", \"enabled\": true},"
+     " {\"key\": \"new checkout\", \"enabled\": true, \"prerequisites\": [\"new payments\"]},"
+     " {\"key\": \"new payments\", \"enabled\": false}]",
+     "{}",
+     "{\"new-payments\": false, \"new-checkout\": false}"},
+    {"[{\"key\": \"a\"}, {\"key\": \"b\", \"prerequisites\": [\"a\"]}, {\"key\": \"a\", \"prerequisites\": [\"b\"]}]",
+     "{}",
+     "{\"a\": false, \"b\": false}",
+     DB_CYCLE},
+    {"[{\"key\": \"a\", \"enabled\": true}, {\"key\": \"a\", \"prerequisites\": [\"nowhere\"]}]",
+     "{}",
+     "{\"a\": true}",
+     DB_INVALID},
+    {"[{\"key\": \"a\", \"enabled\": true}, {\"key\": \"a\", \"rule\": {\"nested\": {\"x\": 1}}}]",
+     "{}",
+     "{\"a\": true}",
+     DB_INVALID},
+};
+
+#define N_CONFORMANCE_CASES (int)(sizeof(conformance_cases) / sizeof(conformance_cases[0]))
+
+// Writes like a replica applying changes: create, or update if it exists.
+static int server_write(sqlite3 *db, struct json_object *flag)
+{
+  int result = db_put_flag(db, flag, true);
+  return result == DB_CONFLICT ? db_put_flag(db, flag, false) : result;
+}
+
+void test_conformance_server(void)
+{
+  for (int c = 0; c < N_CONFORMANCE_CASES; c++)
+  {
+    const struct conformance_case *test = &conformance_cases[c];
+    struct json_object *flags = json_tokener_parse(test->flags);
+    struct json_object *context = json_tokener_parse(test->context);
+    struct json_object *expected = json_tokener_parse(test->expected);
+    sqlite3 *db = NULL;
+    TEST_ASSERT_EQUAL(0, initialize_db_mem(&db));
+
+    size_t n_flags = json_object_array_length(flags);
+    for (size_t k = 0; k < n_flags; k++)
+    {
+      int result = server_write(db, json_object_array_get_idx(flags, k));
+      TEST_ASSERT_EQUAL(k == n_flags - 1 ? test->rejected : DB_OK, result);
+    }
+
+    struct evaluation_plan *plan = db_load_evaluation_plan(db);
+    TEST_ASSERT_NOT_NULL(plan);
+    bool results[16];
+    json_object_object_foreach(expected, key, state)
+    {
+      int step = find_plan_step(plan, key);
+      TEST_ASSERT_TRUE(step >= 0);
+      TEST_ASSERT_EQUAL(json_object_get_boolean(state), evaluate_plan(plan, step, context, results));
+    }
+
+    free_evaluation_plan(plan);
+    TEST_ASSERT_EQUAL(0, close_db(&db));
+    json_object_put(flags);
+    json_object_put(context);
+    json_object_put(expected);
+  }
+}
+
+static void check_library(ff_client *client, const struct conformance_case *test)
+{
+  struct json_object *expected = json_tokener_parse(test->expected);
+  ff_context *context = ff_context_parse(test->context, strlen(test->context));
+  TEST_ASSERT_NOT_NULL(context);
+  json_object_object_foreach(expected, key, state)
+  {
+    TEST_ASSERT_EQUAL(json_object_get_boolean(state), ff_evaluate(client, key, context));
+  }
+  ff_context_free(context);
+  json_object_put(expected);
+}
+
+void test_conformance_library(void)
+{
+  for (int c = 0; c < N_CONFORMANCE_CASES; c++)
+  {
+    const struct conformance_case *test = &conformance_cases[c];
+    struct json_object *flags = json_tokener_parse(test->flags);
+    size_t n_flags = json_object_array_length(flags);
+
+    // One update at a time, like the server's writes.
+    ff_client *client = ff_client_new();
+    for (size_t k = 0; k < n_flags; k++)
+    {
+      const char *flag = json_object_to_json_string(json_object_array_get_idx(flags, k));
+      TEST_ASSERT_EQUAL(k == n_flags - 1 ? test->rejected : FF_OK, ff_apply_update(client, flag, strlen(flag)));
+    }
+    check_library(client, test);
+    ff_client_free(client);
+
+    // All at once, which only keeps the flags if every write is accepted.
+    client = ff_client_new();
+    TEST_ASSERT_EQUAL(test->rejected, ff_load_snapshot(client, test->flags, strlen(test->flags)));
+    if (test->rejected == FF_OK)
+      check_library(client, test);
+    ff_client_free(client);
+    json_object_put(flags);
+  }
+}
+
+void test_library_follows_changes(void)
+{
+  ff_client *client = ff_client_new();
+  const char *changes = "[{\"version\": 1, \"flag\": {\"key\": \"a\", \"enabled\": true}},"
+                        " {\"version\": 2, \"flag\": {\"key\": \"b\", \"prerequisites\": [\"a\"], \"enabled\": true}}]";
+  TEST_ASSERT_EQUAL(FF_OK, ff_apply_changes(client, changes, strlen(changes)));
+  TEST_ASSERT_EQUAL(2, ff_version(client));
+
+  // Replayed and new changes; only version 3 applies.
+  changes = "[{\"version\": 2, \"flag\": {\"key\": \"b\", \"enabled\": false}},"
+            " {\"version\": 3, \"flag\": {\"key\": \"a\", \"enabled\": false}}]";
+  TEST_ASSERT_EQUAL(FF_OK, ff_apply_changes(client, changes, strlen(changes)));
+  TEST_ASSERT_EQUAL(3, ff_version(client));
+
+  ff_context *context = ff_context_new();
+  TEST_ASSERT_EQUAL(0, ff_evaluate(client, "a", context));
+  TEST_ASSERT_EQUAL(0, ff_evaluate(client, "b", context));
+  TEST_ASSERT_EQUAL(-1, ff_evaluate(client, "c", context));
+
+  // A batch that fails applies nothing.
+  changes = "[{\"version\": 4, \"flag\": {\"key\": \"a\", \"enabled\": true}},"
+            " {\"version\": 5, \"flag\": {\"key\": \"c\", \"prerequisites\": [\"nowhere\"]}}]";
+  TEST_ASSERT_EQUAL(FF_INVALID, ff_apply_changes(client, changes, strlen(changes)));
+  TEST_ASSERT_EQUAL(3, ff_version(client));
+  TEST_ASSERT_EQUAL(0, ff_evaluate(client, "a", context));
+
+  ff_context_free(context);
+  ff_client_free(client);
+}
+
+void test_library_contexts(void)
+{
+  ff_client *client = ff_client_new();
+  const char *flags = "[{\"key\": \"f\", \"rule\": {\"plan\": \"pro\", \"seats\": 10, \"beta\": true}}]";
+  TEST_ASSERT_EQUAL(FF_OK, ff_load_snapshot(client, flags, strlen(flags)));
+
+  ff_context *context = ff_context_new();
+  ff_context_set_string(context, "plan", "pro");
+  ff_context_set_int(context, "seats", 10);
+  TEST_ASSERT_EQUAL(0, ff_evaluate(client, "f", context));
+  ff_context_set_bool(context, "beta", 1);
+  TEST_ASSERT_EQUAL(1, ff_evaluate(client, "f", context));
+  ff_context_free(context);
+
+  TEST_ASSERT_NULL(ff_context_parse(STRLIT("{\"nested\": {\"x\": 1}}")));
+  TEST_ASSERT_NULL(ff_context_parse(STRLIT("{\"plan\": ")));
+  ff_client_free(client);
+}
+
+// More flags than fit in results on the stack.
+void test_library_large_plan(void)
+{
+  static char snapshot[1200 * 48];
+  size_t len = 0;
+  snapshot[len++] = '[';
+  for (int k = 0; k < 1200; k++)
+    len += snprintf(snapshot + len, sizeof(snapshot) - len, "%s{\"key\": \"f%d\", \"enabled\": %s}",
+                    k == 0 ? "" : ",", k, k % 2 == 0 ? "true" : "false");
+  snapshot[len++] = ']';
+
+  ff_client *client = ff_client_new();
+  TEST_ASSERT_EQUAL(FF_OK, ff_load_snapshot(client, snapshot, len));
+  ff_context *context = ff_context_new();
+  for (int k = 0; k < 3; k++)
+  {
+    TEST_ASSERT_EQUAL(1, ff_evaluate(client, "f1000", context));
+    TEST_ASSERT_EQUAL(0, ff_evaluate(client, "f1001", context));
+  }
+  ff_context_free(context);
+  ff_client_free(client);
+}
+
+#define N_READERS 4
+
+static void *read_flags(void *client)
+{
+  ff_context *context = ff_context_new();
+  ff_context_set_string(context, "plan", "pro");
+  intptr_t unknown = 0;
+  for (int k = 0; k < 100000; k++)
+    unknown += ff_evaluate(client, "toggled", context) < 0;
+  ff_context_free(context);
+  return (void *)unknown;
+}
+
+void test_library_concurrent_readers(void)
+{
+  ff_client *client = ff_client_new();
+  const char *on = "{\"key\": \"toggled\", \"enabled\": true, \"rule\": {\"plan\": \"pro\"}}";
+  const char *off = "{\"key\": \"toggled\", \"rule\": null, \"enabled\": false}";
+  TEST_ASSERT_EQUAL(FF_OK, ff_apply_update(client, on, strlen(on)));
+
+  pthread_t readers[N_READERS];
+  for (int k = 0; k < N_READERS; k++)
+    TEST_ASSERT_EQUAL(0, pthread_create(&readers[k], NULL, read_flags, client));
+  for (int k = 0; k < 1000; k++)
+  {
+    const char *flag = k % 2 == 0 ? off : on;
+    TEST_ASSERT_EQUAL(FF_OK, ff_apply_update(client, flag, strlen(flag)));
+  }
+  for (int k = 0; k < N_READERS; k++)
+  {
+    void *unknown = NULL;
+    pthread_join(readers[k], &unknown);
+    TEST_ASSERT_EQUAL(0, (intptr_t)unknown);
+  }
+  ff_client_free(client);
+}
+
 int main(void)
 {
   UNITY_BEGIN();
@@ -83,5 +482,16 @@ int main(void)
   RUN_TEST(test_matches_rule_array);
   RUN_TEST(test_matches_rule_empty);
   RUN_TEST(test_is_valid_rule);
+  RUN_TEST(test_plan_orders_prerequisites_first);
+  RUN_TEST(test_plan_prerequisite_gates_flag);
+  RUN_TEST(test_plan_uses_rules);
+  RUN_TEST(test_plan_rejects_cycles);
+  RUN_TEST(test_explain_plan);
+  RUN_TEST(test_conformance_server);
+  RUN_TEST(test_conformance_library);
+  RUN_TEST(test_library_follows_changes);
+  RUN_TEST(test_library_contexts);
+  RUN_TEST(test_library_large_plan);
+  RUN_TEST(test_library_concurrent_readers);
   return UNITY_END();
 }
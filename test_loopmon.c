@@ -0,0 +1,98 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <time.h>
+
+#include "unity/unity.h"
+#include "json-c/json.h"
+
+#include "loopmon.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+  loopmon_stop();
+}
+
+static void sleep_ms(long ms)
+{
+  struct timespec duration = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+  nanosleep(&duration, NULL);
+}
+
+static struct json_object *handler_stats(struct json_object *dump, const char *name)
+{
+  return json_object_object_get(json_object_object_get(dump, "handlers"), name);
+}
+
+void test_records_slow_work(void)
+{
+  TEST_ASSERT_EQUAL(0, loopmon_start(1, 0));
+  loopmon_enter("fast");
+  loopmon_exit();
+
+  loopmon_enter("slow");
+  loopmon_statement("SELECT 1");
+  sleep_ms(3);
+  loopmon_exit();
+
+  // Outside of any work.
+  loopmon_statement("SELECT 2");
+
+  struct json_object *dump = loopmon_dump();
+  struct json_object *fast = handler_stats(dump, "fast");
+  TEST_ASSERT_EQUAL(1, json_object_get_int(json_object_object_get(fast, "count")));
+  TEST_ASSERT_EQUAL(0, json_object_get_int(json_object_object_get(fast, "over_budget")));
+  TEST_ASSERT_EQUAL(1, json_object_get_int(json_object_object_get(handler_stats(dump, "slow"), "over_budget")));
+
+  struct json_object *slow = json_object_array_get_idx(json_object_object_get(dump, "slow"), 0);
+  TEST_ASSERT_EQUAL_STRING("slow", json_object_get_string(json_object_object_get(slow, "handler")));
+  TEST_ASSERT_EQUAL_STRING("SELECT 1", json_object_get_string(json_object_object_get(slow, "statement")));
+  TEST_ASSERT_TRUE(json_object_get_int(json_object_object_get(slow, "us")) >= 3000);
+  json_object_put(dump);
+}
+
+void test_nested_work_counts_once(void)
+{
+  TEST_ASSERT_EQUAL(0, loopmon_start(1000, 0));
+  loopmon_enter("outer");
+  loopmon_enter("inner");
+  loopmon_exit();
+  loopmon_exit();
+
+  struct json_object *dump = loopmon_dump();
+  TEST_ASSERT_EQUAL(1, json_object_get_int(json_object_object_get(handler_stats(dump, "outer"), "count")));
+  TEST_ASSERT_NULL(handler_stats(dump, "inner"));
+  json_object_put(dump);
+}
+
+void test_watchdog_reports_stalls_once(void)
+{
+  // The watchdog runs on the real clock, so the margins are wide: it checks
+  // every 12.5ms and has ten times the stall threshold to notice.
+  TEST_ASSERT_EQUAL(0, loopmon_start(1000, 50));
+  uint64_t before = loopmon_stalls();
+
+  loopmon_enter("stuck");
+  loopmon_statement("SELECT * FROM feature_flags");
+  sleep_ms(500);
+  TEST_ASSERT_EQUAL(before + 1, loopmon_stalls());
+  loopmon_exit();
+
+  loopmon_enter("quick");
+  loopmon_exit();
+  sleep_ms(200);
+  TEST_ASSERT_EQUAL(before + 1, loopmon_stalls());
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_records_slow_work);
+  RUN_TEST(test_nested_work_counts_once);
+  RUN_TEST(test_watchdog_reports_stalls_once);
+  return UNITY_END();
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "unity/unity.h"
+#include "json-c/json.h"
+
+#include "evaluation.h"
+#include "msgpack.h"
+#include "common.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_decode_context(void)
+{
+  // { "userId": 5, "carMake": "Honda" }
+  const uint8_t buf[] = {0x82,
+                         0xa6, 'u', 's', 'e', 'r', 'I', 'd', 0x05,
+                         0xa7, 'c', 'a', 'r', 'M', 'a', 'k', 'e', 0xa5, 'H', 'o', 'n', 'd', 'a'};
+  struct json_object *context = msgpack_decode_context(buf, sizeof(buf));
+  TEST_ASSERT_NOT_NULL(context);
+  TEST_ASSERT_TRUE(is_valid_context(context));
+
+  struct json_object *rule = json_tokener_parse("{ \"userId\": 5, \"carMake\": [\"Honda\", \"Mazda\"] }");
+  TEST_ASSERT_TRUE(matches_rule(rule, context));
+
+  json_object_put(rule);
+  json_object_put(context);
+}
+
+void test_decode_scalars(void)
+{
+  // { "n": -123 (int16), "f": true, "u": 300 (uint16) }
+  const uint8_t buf[] = {0x83,
+                         0xa1, 'n', 0xd1, 0xff, 0x85,
+                         0xa1, 'f', 0xc3,
+                         0xa1, 'u', 0xcd, 0x01, 0x2c};
+  struct json_object *context = msgpack_decode_context(buf, sizeof(buf));
+  TEST_ASSERT_NOT_NULL(context);
+  TEST_ASSERT_EQUAL(-123, json_object_get_int64(json_object_object_get(context, "n")));
+  TEST_ASSERT_TRUE(json_object_get_boolean(json_object_object_get(context, "f")));
+  TEST_ASSERT_EQUAL(300, json_object_get_int64(json_object_object_get(context, "u")));
+  json_object_put(context);
+}
+
+void test_decode_rejects_malformed(void)
+{
+  // { "a": [1] } is deeper than a context may be.
+  const uint8_t nested[] = {0x81, 0xa1, 'a', 0x91, 0x01};
+  TEST_ASSERT_NULL(msgpack_decode_context(nested, sizeof(nested)));
+
+  // { "a": 1 } cut short, and followed by garbage.
+  const uint8_t valid[] = {0x81, 0xa1, 'a', 0x01, 0xff};
+  TEST_ASSERT_NULL(msgpack_decode_context(valid, 3));
+  TEST_ASSERT_NULL(msgpack_decode_context(valid, sizeof(valid)));
+
+  // Not a map at all.
+  const uint8_t scalar[] = {0x01};
+  TEST_ASSERT_NULL(msgpack_decode_context(scalar, sizeof(scalar)));
+
+  // `nil` decodes, but isn't a valid context.
+  const uint8_t nil[] = {0x81, 0xa1, 'a', 0xc0};
+  struct json_object *context = msgpack_decode_context(nil, sizeof(nil));
+  TEST_ASSERT_NOT_NULL(context);
+  TEST_ASSERT_FALSE(is_valid_context(context));
+  json_object_put(context);
+}
+
+void test_writers_round_trip(void)
+{
+  uint8_t buf[128];
+  uint8_t *end = msgpack_write_map_header(buf, 4);
+  end = msgpack_write_str(end, STRLIT("big"));
+  end = msgpack_write_int(end, -100000);
+  end = msgpack_write_str(end, STRLIT("ratio"));
+  end = msgpack_write_double(end, 1.5);
+  end = msgpack_write_str(end, STRLIT("enabled"));
+  end = msgpack_write_bool(end, false);
+  end = msgpack_write_str(end, STRLIT("a key that is longer than thirty-one bytes"));
+  end = msgpack_write_int(end, 7);
+
+  struct json_object *context = msgpack_decode_context(buf, end - buf);
+  TEST_ASSERT_NOT_NULL(context);
+  TEST_ASSERT_EQUAL(-100000, json_object_get_int64(json_object_object_get(context, "big")));
+  TEST_ASSERT_TRUE(json_object_get_double(json_object_object_get(context, "ratio")) == 1.5);
+  TEST_ASSERT_FALSE(json_object_get_boolean(json_object_object_get(context, "enabled")));
+  TEST_ASSERT_EQUAL(7, json_object_get_int64(json_object_object_get(context, "a key that is longer than thirty-one bytes")));
+  json_object_put(context);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_decode_context);
+  RUN_TEST(test_decode_scalars);
+  RUN_TEST(test_decode_rejects_malformed);
+  RUN_TEST(test_writers_round_trip);
+  return UNITY_END();
+}
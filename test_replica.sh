@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Starts a primary and a replica on localhost, writes flags through the
+# primary and checks that the replica picks them up and rejects writes.
+
+set -e
+
+BIN=${BIN:-./fastforward_debug}
+WORKDIR=$(mktemp -d)
+PRIMARY=127.0.0.1:7891
+REPLICA=127.0.0.1:7892
+
+cleanup() {
+  kill $PIDS 2>/dev/null || true
+  rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+wait_for() {
+  for _ in $(seq 50); do
+    curl -fs "http://$1/ping" >/dev/null 2>&1 && return 0
+    sleep 0.1
+  done
+  echo "FAIL: $1 did not come up" >&2
+  exit 1
+}
+
+expect() {
+  if [ "$2" != "$3" ]; then
+    echo "FAIL: $1: expected '$3', got '$2'" >&2
+    exit 1
+  fi
+  echo "ok: $1"
+}
+
+evaluate() {
+  curl -s -H 'Content-Type: application/json' -d '{ "country": "US" }' "http://$1/evaluate/$2"
+}
+
+put_flag() {
+  curl -s -o /dev/null -w '%{http_code}' -X "$2" -H 'Content-Type: application/json' -d "$3" "http://$1/flag/"
+}
+
+# Replicas poll the primary, so give them a few poll intervals to catch up.
+expect_eventually() {
+  for _ in $(seq 50); do
+    got=$(evaluate "$2" "$3")
+    [ "$got" = "$4" ] && break
+    sleep 0.1
+  done
+  expect "$1" "$got" "$4"
+}
+
+FF_PORT=7891 FF_DB_PATH="$WORKDIR/primary.db" "$BIN" >"$WORKDIR/primary.log" 2>&1 &
+PIDS="$!"
+wait_for $PRIMARY
+
+put_flag $PRIMARY POST '{ "key": "payments", "enabled": true }' >/dev/null
+put_flag $PRIMARY POST '{ "key": "checkout-v2", "rule": { "country": ["US"] }, "prerequisites": ["payments"] }' >/dev/null
+
+FF_PORT=7892 FF_REPLICA_OF=$PRIMARY "$BIN" >"$WORKDIR/replica.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_for $REPLICA
+
+expect "primary evaluates" "$(evaluate $PRIMARY checkout-v2)" '{"payments":true,"checkout-v2":true}'
+expect_eventually "replica catches up" $REPLICA checkout-v2 '{"payments":true,"checkout-v2":true}'
+
+put_flag $PRIMARY PUT '{ "key": "payments", "enabled": false }' >/dev/null
+expect "primary applies updates" "$(evaluate $PRIMARY checkout-v2)" '{"payments":false,"checkout-v2":false}'
+expect_eventually "replica follows updates" $REPLICA checkout-v2 '{"payments":false,"checkout-v2":false}'
+
+expect "replica rejects writes" \
+  "$(put_flag $REPLICA POST '{ "key": "other" }')" \
+  "403"
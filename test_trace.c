@@ -0,0 +1,60 @@
+#include <stdio.h>
+
+#include "unity/unity.h"
+#include "json-c/json.h"
+
+#include "trace.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+  trace_set_sampling(0);
+}
+
+static int count_traced(int n_requests, bool force)
+{
+  int traced = 0;
+  for (int k = 0; k < n_requests; k++)
+  {
+    struct trace trace;
+    trace_begin(&trace, force);
+    traced += trace.active;
+    TRACE_MARK(&trace, TRACE_PARSE);
+    trace_end(&trace);
+  }
+  return traced;
+}
+
+void test_sampling(void)
+{
+  TEST_ASSERT_EQUAL(0, count_traced(100, false));
+  TEST_ASSERT_EQUAL(100, count_traced(100, true));
+
+  trace_set_sampling(4);
+  TEST_ASSERT_EQUAL(25, count_traced(100, false));
+}
+
+void test_ring_keeps_latest(void)
+{
+  trace_set_sampling(1);
+  count_traced(TRACE_RING_SIZE + 10, false);
+
+  struct json_object *traces = trace_dump();
+  TEST_ASSERT_EQUAL(TRACE_RING_SIZE, json_object_array_length(traces));
+
+  int64_t first = json_object_get_int64(json_object_object_get(json_object_array_get_idx(traces, 0), "sequence"));
+  int64_t last = json_object_get_int64(json_object_object_get(json_object_array_get_idx(traces, TRACE_RING_SIZE - 1), "sequence"));
+  TEST_ASSERT_EQUAL(TRACE_RING_SIZE - 1, last - first);
+  json_object_put(traces);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sampling);
+  RUN_TEST(test_ring_keeps_latest);
+  return UNITY_END();
+}
@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "json-c/json.h"
+
+// With sampling off the countdown starts so high it never reaches zero.
+uint64_t trace_countdown = UINT64_MAX;
+static uint64_t sample_every = 0;
+
+static struct trace_record ring[TRACE_RING_SIZE];
+static uint64_t ring_head = 0;
+
+static const char *stage_names[TRACE_N_STAGES] = {
+    "parse",
+    "validate",
+    "lookup",
+    "match",
+    "record",
+    "respond",
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_set_sampling(uint64_t every)
+{
+  sample_every = every;
+  trace_countdown = every == 0 ? UINT64_MAX : every;
+}
+
+bool trace_start(struct trace *trace)
+{
+  if (trace_countdown == 0)
+    trace_countdown = sample_every == 0 ? UINT64_MAX : sample_every;
+
+  memset(&trace->record, 0, sizeof(trace->record));
+  trace->last_ns = trace->record.started_at_ns = now_ns();
+  return true;
+}
+
+void trace_mark(struct trace *trace, enum trace_stage stage)
+{
+  uint64_t now = now_ns();
+  trace->record.stage_ns[stage] += now - trace->last_ns;
+  trace->last_ns = now;
+}
+
+void trace_end(struct trace *trace)
+{
+  if (!trace->active)
+    return;
+
+  // Claim a slot, and mark it as being written while it's filled in so that
+  // `trace_dump` skips it instead of reading a torn record.
+  uint64_t ticket = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+  struct trace_record *slot = &ring[ticket % TRACE_RING_SIZE];
+  __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->started_at_ns = trace->record.started_at_ns;
+  slot->n_evaluated = trace->record.n_evaluated;
+  memcpy(slot->stage_ns, trace->record.stage_ns, sizeof(slot->stage_ns));
+  memcpy(slot->flag_key, trace->record.flag_key, sizeof(slot->flag_key));
+
+  __atomic_store_n(&slot->sequence, ticket + 1, __ATOMIC_RELEASE);
+}
+
+struct json_object *trace_stages_json(const struct trace_record *record)
+{
+  struct json_object *stages = json_object_new_object();
+  for (int k = 0; k < TRACE_N_STAGES; k++)
+    json_object_object_add(stages, stage_names[k], json_object_new_int64((int64_t)record->stage_ns[k]));
+  return stages;
+}
+
+struct json_object *trace_dump(void)
+{
+  struct json_object *traces = json_object_new_array();
+  uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+  for (uint64_t ticket = first; ticket < head; ticket++)
+  {
+    const struct trace_record *slot = &ring[ticket % TRACE_RING_SIZE];
+    struct trace_record copy;
+    uint64_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    memcpy(&copy, slot, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (before != ticket + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != before)
+      continue;
+
+    struct json_object *entry = json_object_new_object();
+    json_object_object_add(entry, "sequence", json_object_new_int64((int64_t)copy.sequence));
+    json_object_object_add(entry, "started_at_ns", json_object_new_int64((int64_t)copy.started_at_ns));
+    json_object_object_add(entry, "flag", copy.flag_key[0] == '\0' ? NULL : json_object_new_string(copy.flag_key));
+    json_object_object_add(entry, "evaluated", json_object_new_int(copy.n_evaluated));
+    json_object_object_add(entry, "stages_ns", trace_stages_json(&copy));
+    json_object_array_add(traces, entry);
+  }
+  return traces;
+}
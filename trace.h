@@ -0,0 +1,78 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct json_object;
+
+// Stages of an evaluation request, in order.
+enum trace_stage
+{
+  TRACE_PARSE,
+  TRACE_VALIDATE,
+  TRACE_LOOKUP,
+  TRACE_MATCH,
+  TRACE_RECORD,
+  TRACE_RESPOND,
+  TRACE_N_STAGES
+};
+
+#define TRACE_RING_SIZE 256
+#define TRACE_KEY_LEN 64
+
+struct trace_record
+{
+  // Zero while the slot is being written.
+  uint64_t sequence;
+  uint64_t started_at_ns;
+  uint64_t stage_ns[TRACE_N_STAGES];
+  int n_evaluated;
+  char flag_key[TRACE_KEY_LEN];
+};
+
+struct trace
+{
+  bool active;
+  uint64_t last_ns;
+  struct trace_record record;
+};
+
+// Requests left until the next sampled one. Only touched by `trace_begin`.
+extern uint64_t trace_countdown;
+
+// Trace 1 in `every` requests. 0 turns sampling off.
+void trace_set_sampling(uint64_t every);
+
+// Slow path of `trace_begin`.
+bool trace_start(struct trace *trace);
+
+// Decide whether to trace this request: every sampled request, and every
+// request with `force` set (explain mode). When not tracing, this costs a
+// decrement and a branch.
+static inline void trace_begin(struct trace *trace, bool force)
+{
+  trace->active = false;
+  if (__builtin_expect(--trace_countdown == 0 || force, 0))
+    trace->active = trace_start(trace);
+}
+
+// Attribute the time since the previous mark to `stage`.
+#define TRACE_MARK(trace, stage)  \
+  if ((trace)->active)            \
+  {                               \
+    trace_mark((trace), (stage)); \
+  }
+
+void trace_mark(struct trace *trace, enum trace_stage stage);
+
+// Publish a finished trace to the ring buffer.
+void trace_end(struct trace *trace);
+
+// Per-stage timings of `trace` as a JSON object.
+struct json_object *trace_stages_json(const struct trace_record *record);
+
+// Everything currently in the ring buffer, oldest first.
+struct json_object *trace_dump(void);
+
+#endif // TRACE_H_